@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <event.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "pkg.h"
+
+/*
+ * A bounded LRU of rendered responses.  Entries are allocated in one
+ * chunk: the struct, followed by the key and then the data.
+ */
+
+struct cache_entry {
+	char			*ce_key;
+	uint8_t			*ce_data;
+	size_t			 ce_len;
+
+	RB_ENTRY(cache_entry)	 ce_node;
+	TAILQ_ENTRY(cache_entry) ce_lru;
+};
+
+static int	cache_entry_cmp(struct cache_entry *, struct cache_entry *);
+static void	cache_evict(struct cache *);
+
+RB_PROTOTYPE_STATIC(cache_tree, cache_entry, ce_node, cache_entry_cmp);
+
+void
+cache_init(struct cache *cache, const char *name, size_t maxentries,
+    size_t maxsize)
+{
+	memset(cache, 0, sizeof(*cache));
+
+	cache->c_name = name;
+	cache->c_maxentries = maxentries;
+	cache->c_maxsize = maxsize;
+	RB_INIT(&cache->c_tree);
+	TAILQ_INIT(&cache->c_lru);
+}
+
+int
+cache_get(struct cache *cache, const char *key, uint8_t **data, size_t *len)
+{
+	struct cache_entry	*ce, q;
+
+	q.ce_key = (char *)key;
+	if ((ce = RB_FIND(cache_tree, &cache->c_tree, &q)) == NULL) {
+		cache->c_misses++;
+		return (0);
+	}
+
+	cache->c_hits++;
+
+	TAILQ_REMOVE(&cache->c_lru, ce, ce_lru);
+	TAILQ_INSERT_HEAD(&cache->c_lru, ce, ce_lru);
+
+	*data = ce->ce_data;
+	*len = ce->ce_len;
+	return (1);
+}
+
+void
+cache_put(struct cache *cache, const char *key, const uint8_t *data,
+    size_t len)
+{
+	struct cache_entry	*ce, *old;
+	size_t			 klen, size;
+
+	/* don't let a single entry wipe out the whole cache */
+	if (cache->c_maxentries == 0 || len > cache->c_maxsize / 4)
+		return;
+
+	klen = strlen(key) + 1;
+	size = sizeof(*ce) + klen + len;
+	if ((ce = malloc(size)) == NULL) {
+		log_warn("%s: malloc", __func__);
+		return;
+	}
+
+	ce->ce_key = (char *)(ce + 1);
+	ce->ce_data = (uint8_t *)ce->ce_key + klen;
+	ce->ce_len = len;
+	memcpy(ce->ce_key, key, klen);
+	memcpy(ce->ce_data, data, len);
+
+	if ((old = RB_INSERT(cache_tree, &cache->c_tree, ce)) != NULL) {
+		/* someone else rendered it first */
+		free(ce);
+		return;
+	}
+
+	TAILQ_INSERT_HEAD(&cache->c_lru, ce, ce_lru);
+	cache->c_nentries++;
+	cache->c_size += size;
+
+	while (cache->c_nentries > cache->c_maxentries ||
+	    cache->c_size > cache->c_maxsize)
+		cache_evict(cache);
+}
+
+static void
+cache_evict(struct cache *cache)
+{
+	struct cache_entry	*ce;
+
+	if ((ce = TAILQ_LAST(&cache->c_lru, cache_lru)) == NULL)
+		return;
+
+	TAILQ_REMOVE(&cache->c_lru, ce, ce_lru);
+	RB_REMOVE(cache_tree, &cache->c_tree, ce);
+	cache->c_nentries--;
+	cache->c_size -= sizeof(*ce) + strlen(ce->ce_key) + 1 + ce->ce_len;
+	cache->c_evictions++;
+	free(ce);
+}
+
+void
+cache_clear(struct cache *cache)
+{
+	struct cache_entry	*ce;
+
+	while ((ce = TAILQ_FIRST(&cache->c_lru)) != NULL) {
+		TAILQ_REMOVE(&cache->c_lru, ce, ce_lru);
+		RB_REMOVE(cache_tree, &cache->c_tree, ce);
+		free(ce);
+	}
+
+	cache->c_nentries = 0;
+	cache->c_size = 0;
+	cache->c_gen++;
+}
+
+void
+cache_stats(struct cache *cache)
+{
+	unsigned long long	 lookups;
+	double			 ratio = 0;
+
+	lookups = cache->c_hits + cache->c_misses;
+	if (lookups != 0)
+		ratio = 100.0 * cache->c_hits / lookups;
+
+	log_notice("%s cache: %zu entries, %zu bytes, %llu hits, %llu misses"
+	    " (%.1f%% hit ratio), %llu evictions", cache->c_name,
+	    cache->c_nentries, cache->c_size, cache->c_hits,
+	    cache->c_misses, ratio, cache->c_evictions);
+}
+
+static int
+cache_entry_cmp(struct cache_entry *a, struct cache_entry *b)
+{
+	return (strcmp(a->ce_key, b->ce_key));
+}
+
+RB_GENERATE_STATIC(cache_tree, cache_entry, ce_node, cache_entry_cmp);
@@ -0,0 +1,37 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#ifdef __cplusplus
+# error "Do not use C++: this is a C application."
+#endif
+
+#define HAVE_ACCEPT4		1
+#define HAVE_ERR		1
+#define HAVE_FREEZERO		0
+#define HAVE_GETDTABLECOUNT	0
+#define HAVE_GETDTABLESIZE	1
+#define HAVE_GETEXECNAME	0
+#define HAVE_GETPROGNAME	0
+#define HAVE_INOTIFY		1
+#define HAVE_KQUEUE		0
+#define HAVE_LIBEVENT		1
+#define HAVE_LIBSQLITE3		1
+#define HAVE_MEMFD		1
+#define HAVE_PLEDGE		0
+#define HAVE_PTHREAD		1
+#define HAVE_REALLOCARRAY	1
+#define HAVE_RECALLOCARRAY	0
+#define HAVE_SETGROUPS		1
+#define HAVE_SETPROCTITLE	0
+#define HAVE_SETRESGID		1
+#define HAVE_SETRESUID		1
+#define HAVE_STRLCAT		0
+#define HAVE_STRLCPY		0
+#define HAVE_STRTONUM		0
+#define HAVE_SYS_QUEUE		0
+#define HAVE_SYS_TREE		0
+#define HAVE_UNVEIL		0
+#define HAVE_VASPRINTF		1
+#define HAVE___PROGNAME		1
+
+#endif
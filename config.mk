@@ -0,0 +1,14 @@
+CC=		cc
+CFLAGS=		-I compat/ -I compat/sys -O2 -pipe  -Wall -Wextra -Wpointer-arith -Wuninitialized -Wstrict-prototypes -Wmissing-prototypes -Wunused -Wsign-compare -Wshadow -Wno-unused-parameter -Wno-missing-field-initializers -Wno-pointer-sign -Werror -I. -Itemplate -MMD -D_GNU_SOURCE -I/usr/local/include -D_GNU_SOURCE -D_GNU_SOURCE -D_GNU_SOURCE -D_GNU_SOURCE
+LIBS=		 -levent -L/usr/local/lib -lsqlite3
+LDFLAGS=	
+YACC=		yacc
+
+COMPATS=	compat/unveil.c compat/strtonum.c compat/strlcpy.c compat/strlcat.c compat/setproctitle.c compat/recallocarray.c compat/pledge.c compat/getprogname.c compat/getdtablecount.c compat/freezero.c 
+
+INSTALL=	install
+INSTALL_PROGRAM=${INSTALL} -m 0555
+INSTALL_LIB=	${INSTALL} -m 0444
+INSTALL_MAN=	${INSTALL} -m 0444
+INSTALL_DATA=	${INSTALL} -m 0444
+
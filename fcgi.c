@@ -17,6 +17,7 @@
 #include <sys/queue.h>
 #include <sys/tree.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -24,11 +25,14 @@
 #include <errno.h>
 #include <event.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "log.h"
@@ -40,6 +44,21 @@
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
 
+#ifndef LIBEVENT_VERSION_NUMBER
+/* libevent 1.4 keeps the whole buffer contiguous anyway */
+#define evbuffer_pullup(buf, len)	EVBUFFER_DATA(buf)
+#endif
+
+/* writes at least this big are framed in place, even if they'd fit */
+#define CLT_DIRECT	2048
+
+/* control messages waiting for room on CTL_FD */
+#define CTL_QUEUE	16
+
+/* retry accept after running out of descriptors, in ms */
+#define PAUSE_MIN	10
+#define PAUSE_MAX	1000
+
 struct fcgi_header {
 	unsigned char version;
 	unsigned char type;
@@ -111,6 +130,11 @@ struct fcgi_end_req_body {
 	unsigned char reserved[3];
 };
 
+struct fcgi_unknown_type_body {
+	unsigned char type;
+	unsigned char reserved[7];
+};
+
 /*
  * values for proto_status
  */
@@ -129,43 +153,272 @@ struct fcgi_end_req_body {
 
 #define CAT(f0, f1)	((f0) + ((f1) << 8))
 
-enum {
-	FCGI_RECORD_HEADER,
-	FCGI_RECORD_BODY,
-};
-
 volatile int	fcgi_inflight;
 int32_t		fcgi_id;
 
+/* requests in progress across all the connections */
+static int	fcgi_nclients;
+
+static struct ctl_msg	ctl_queue[CTL_QUEUE];
+static int		ctl_nqueue;
+static struct event	ctl_wev;
+
+/* clients kept around for the next requests */
+static TAILQ_HEAD(, client)	clt_pool = TAILQ_HEAD_INITIALIZER(clt_pool);
+static int			clt_npool;
+
+static unsigned long long	stat_clt_alloc;
+static unsigned long long	stat_clt_reused;
+static unsigned long long	stat_arena_spills;
+
+/* output bytes copied through clt_buf vs. framed in place */
+static unsigned long long	stat_staged;
+static unsigned long long	stat_direct;
+static unsigned long long	stat_records;
+static unsigned long long	stat_replies;
+
+/*
+ * Descriptors in use other than the connections, -1 when they have to
+ * be counted again.
+ */
+static int			fd_base = -1;
+
+/*
+ * Highest descriptor seen in use: a new one is never past the highest
+ * open plus one, so the scans stop a bit after it.
+ */
+static int			fd_high;
+#define FD_SLACK		64
+
+static unsigned long long	stat_fd_scans;
+static unsigned long long	stat_fd_drift;
+
+/* accept wakeups, connections taken and turned away */
+static unsigned long long	stat_wakeups;
+static unsigned long long	stat_accepted;
+static unsigned long long	stat_deferred;
+static unsigned long long	stat_refused;
+
+/* accept is paused while paused_env is set */
+static struct env		*paused_env;
+static struct timespec		 paused_since;
+static int			 pause_ms;
+static unsigned long long	 stat_paused_ns;
+
+/* exclusive mode: not accepting while above the average load */
+static int			 avg_load = INT_MAX;
+static int			 aside;
+static unsigned long long	 stat_aside;
+
 int	accept_reserve(int, struct sockaddr *, socklen_t *, int,
     volatile int *);
 
 static int
-fcgi_send_end_req(struct fcgi *fcgi, int id, int as, int ps)
+fcgi_send_record(struct fcgi *fcgi, int type, int id, const void *body,
+    size_t len)
 {
 	struct bufferevent	*bev = fcgi->fcg_bev;
 	struct fcgi_header	 hdr;
-	struct fcgi_end_req_body end;
 
 	memset(&hdr, 0, sizeof(hdr));
-	memset(&end, 0, sizeof(end));
 
 	hdr.version = FCGI_VERSION_1;
-	hdr.type = FCGI_END_REQUEST;
+	hdr.type = type;
 	hdr.req_id0 = (id & 0xFF);
 	hdr.req_id1 = (id >> 8);
-	hdr.content_len0 = sizeof(end);
-
-	end.app_status0 = (unsigned char)as;
-	end.proto_status = (unsigned char)ps;
+	hdr.content_len0 = (len & 0xFF);
+	hdr.content_len1 = (len >> 8);
 
 	if (bufferevent_write(bev, &hdr, sizeof(hdr)) == -1)
 		return (-1);
-	if (bufferevent_write(bev, &end, sizeof(end)) == -1)
+	if (bufferevent_write(bev, body, len) == -1)
 		return (-1);
 	return (0);
 }
 
+static int
+fcgi_send_end_req(struct fcgi *fcgi, int id, int as, int ps)
+{
+	struct fcgi_end_req_body end;
+
+	memset(&end, 0, sizeof(end));
+
+	end.app_status0 = (unsigned char)as;
+	end.proto_status = (unsigned char)ps;
+
+	return (fcgi_send_record(fcgi, FCGI_END_REQUEST, id, &end,
+	    sizeof(end)));
+}
+
+/*
+ * Get a client from the pool, or allocate a new one.  Everything but
+ * the arena and the output and record buffers, which are kept, is
+ * zeroed.
+ */
+static struct client *
+clt_alloc(void)
+{
+	struct client		*clt;
+	char			*buf = NULL;
+	uint8_t			*rec = NULL;
+	size_t			 bufsize = 0, recsize = 0;
+
+	if ((clt = TAILQ_FIRST(&clt_pool)) != NULL) {
+		TAILQ_REMOVE(&clt_pool, clt, clt_entry);
+		clt_npool--;
+		stat_clt_reused++;
+		buf = clt->clt_buf;
+		bufsize = clt->clt_bufsize;
+		rec = clt->clt_rec;
+		recsize = clt->clt_recsize;
+	} else {
+		if ((clt = malloc(sizeof(*clt))) == NULL)
+			return (NULL);
+		stat_clt_alloc++;
+	}
+
+	memset(clt, 0, offsetof(struct client, clt_arena));
+	clt->clt_buf = buf;
+	clt->clt_bufsize = bufsize;
+	clt->clt_rec = rec;
+	clt->clt_recsize = recsize;
+	return (clt);
+}
+
+static void
+clt_recycle(struct client *clt)
+{
+	int			 i;
+
+	clt_strfree(clt, clt->clt_pval);
+	clt_strfree(clt, clt->clt_cachekey);
+	clt_strfree(clt, clt->clt_server_name);
+	clt_strfree(clt, clt->clt_script_name);
+	clt_strfree(clt, clt->clt_path_info);
+	clt_strfree(clt, clt->clt_query);
+	for (i = 0; i < conf.cf_nparams; ++i)
+		clt_strfree(clt, clt->clt_params[i]);
+
+	if (clt_npool >= CLT_POOL) {
+		free(clt->clt_buf);
+		free(clt->clt_rec);
+		free(clt);
+		return;
+	}
+
+	/* don't let a big reply pin its buffers */
+	if (clt->clt_bufsize > CLT_POOL_BUFSIZE) {
+		free(clt->clt_buf);
+		clt->clt_buf = NULL;
+		clt->clt_bufsize = 0;
+	}
+	if (clt->clt_recsize > CLT_POOL_BUFSIZE) {
+		free(clt->clt_rec);
+		clt->clt_rec = NULL;
+		clt->clt_recsize = 0;
+	}
+
+	TAILQ_INSERT_HEAD(&clt_pool, clt, clt_entry);
+	clt_npool++;
+}
+
+/*
+ * Get len bytes from the client arena, falling back to the heap when
+ * it's full.  Strings are released all together when the client is
+ * recycled, see clt_strfree.
+ */
+char *
+clt_stralloc(struct client *clt, size_t len)
+{
+	char			*p;
+
+	if (len > sizeof(clt->clt_arena) - clt->clt_arenalen) {
+		stat_arena_spills++;
+		return (malloc(len));
+	}
+
+	p = &clt->clt_arena[clt->clt_arenalen];
+	clt->clt_arenalen += len;
+	return (p);
+}
+
+char *
+clt_strndup(struct client *clt, const char *str, size_t len)
+{
+	char			*p;
+
+	if ((p = clt_stralloc(clt, len + 1)) == NULL)
+		return (NULL);
+	memcpy(p, str, len);
+	p[len] = '\0';
+	return (p);
+}
+
+char *
+clt_strdup(struct client *clt, const char *str)
+{
+	return (clt_strndup(clt, str, strlen(str)));
+}
+
+void
+clt_strfree(struct client *clt, char *str)
+{
+	if (str < clt->clt_arena ||
+	    str >= clt->clt_arena + sizeof(clt->clt_arena))
+		free(str);
+}
+
+static inline struct client *
+fcgi_client_find(struct fcgi *fcgi, int id)
+{
+	if ((size_t)id >= fcgi->fcg_maxclients)
+		return (NULL);
+	return (fcgi->fcg_clients[id]);
+}
+
+/*
+ * Request ids are 16 bits and frontends reuse the small ones, so
+ * the table is indexed directly and grows to fit the biggest id.
+ * Ids above MAX_REQUESTS are refused, which bounds the table, and so
+ * is 0, reserved for the management records.
+ */
+static int
+fcgi_client_insert(struct fcgi *fcgi, struct client *clt)
+{
+	struct client		**t;
+	size_t			  n;
+
+	if (clt->clt_id >= fcgi->fcg_maxclients) {
+		n = fcgi->fcg_maxclients == 0 ? 16 : fcgi->fcg_maxclients;
+		while (n <= clt->clt_id)
+			n *= 2;
+		if (n > MAX_REQUESTS + 1)
+			n = MAX_REQUESTS + 1;
+
+		t = recallocarray(fcgi->fcg_clients, fcgi->fcg_maxclients,
+		    n, sizeof(*t));
+		if (t == NULL)
+			return (-1);
+		fcgi->fcg_clients = t;
+		fcgi->fcg_maxclients = n;
+	}
+
+	fcgi->fcg_clients[clt->clt_id] = clt;
+	return (0);
+}
+
+static void
+fcgi_client_free(struct fcgi *fcgi, struct client *clt)
+{
+	fcgi->fcg_clients[clt->clt_id] = NULL;
+	fcgi->fcg_nclients--;
+	if (clt->clt_resume != NULL)
+		TAILQ_REMOVE(&fcgi->fcg_suspended, clt, clt_entry);
+	server_client_free(clt);
+	clt_recycle(clt);
+	fcgi_nclients--;
+}
+
 static int
 end_request(struct client *clt, int status, int proto_status)
 {
@@ -182,10 +435,10 @@ end_request(struct client *clt, int status, int proto_status)
 		return (-1);
 	}
 
-	SPLAY_REMOVE(client_tree, &fcgi->fcg_clients, clt);
-	server_client_free(clt);
+	fcgi_client_free(fcgi, clt);
+	stat_replies++;
 
-	if (!fcgi->fcg_keep_conn)
+	if (!fcgi->fcg_keep_conn && fcgi->fcg_nclients == 0)
 		fcgi->fcg_done = 1;
 
 	return (0);
@@ -197,49 +450,188 @@ fcgi_end_request(struct client *clt, int status)
 	return (end_request(clt, status, FCGI_REQUEST_COMPLETE));
 }
 
+/*
+ * End a request we won't serve.  One whose reply already started
+ * can only be completed, with an error.
+ */
 int
 fcgi_abort_request(struct client *clt)
 {
+	if (clt->clt_output || clt->clt_buflen > 0)
+		return (fcgi_end_request(clt, 1));
 	return (end_request(clt, 1, FCGI_OVERLOADED));
 }
 
+/*
+ * Send the queued control messages, in order, until the socket is
+ * full; then try again once it's writable.
+ */
 static void
-fcgi_inflight_dec(const char *why)
+ctl_flush(int fd, short ev, void *arg)
 {
-	fcgi_inflight--;
-	log_debug("%s: fcgi inflight decremented, now %d, %s",
-	    __func__, fcgi_inflight, why);
+	int			 i;
+
+	for (i = 0; i < ctl_nqueue; ++i) {
+		if (send(CTL_FD, &ctl_queue[i], sizeof(ctl_queue[i]),
+		    0) == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			log_warn("%s: send", __func__);
+		}
+	}
+
+	ctl_nqueue -= i;
+	memmove(ctl_queue, ctl_queue + i, ctl_nqueue * sizeof(*ctl_queue));
+
+	if (ctl_nqueue > 0 && !event_pending(&ctl_wev, EV_WRITE, NULL)) {
+		event_set(&ctl_wev, CTL_FD, EV_WRITE, ctl_flush, NULL);
+		event_add(&ctl_wev, NULL);
+	}
 }
 
 void
-fcgi_accept(int fd, short event, void *arg)
+ctl_send(int type, int value)
 {
-	struct env		*env = arg;
-	struct fcgi		*fcgi = NULL;
-	socklen_t		 slen;
-	struct sockaddr_storage	 ss;
-	int			 s = -1;
+	struct ctl_msg		*msg;
+	int			 i;
+
+	/* only the latest figures matter */
+	if (type == CTL_LOAD || type == CTL_BUSY) {
+		for (i = 0; i < ctl_nqueue; ++i) {
+			if (ctl_queue[i].m_type == type) {
+				ctl_queue[i].m_value = value;
+				return;
+			}
+		}
+	}
 
-	event_add(&env->env_pausev, NULL);
-	if ((event & EV_TIMEOUT))
+	if (ctl_nqueue == CTL_QUEUE) {
+		log_warnx("%s: queue full, dropping message %d", __func__,
+		    type);
 		return;
+	}
 
-	slen = sizeof(ss);
-	if ((s = accept_reserve(env->env_sockfd, (struct sockaddr *)&ss,
-	    &slen, FD_RESERVE, &fcgi_inflight)) == -1) {
-		/*
-		 * Pause accept if we are out of file descriptors, or
-		 * libevent will haunt us here too.
-		 */
-		if (errno == ENFILE || errno == EMFILE) {
-			struct timeval evtpause = { 1, 0 };
+	msg = &ctl_queue[ctl_nqueue++];
+	memset(msg, 0, sizeof(*msg));
+	msg->m_type = type;
+	msg->m_value = value;
+	ctl_flush(CTL_FD, EV_WRITE, NULL);
+}
 
-			event_del(&env->env_sockev);
-			evtimer_add(&env->env_pausev, &evtpause);
-			log_debug("%s: deferring connections", __func__);
-		}
-		return;
+static int
+fcgi_fds_left(void)
+{
+	return (fd_count() + FD_RESERVE + fcgi_inflight < getdtablesize());
+}
+
+/*
+ * Stop accepting.  If we ran into our own reserve, accept resumes
+ * as soon as a connection goes away and the timer is only a safety
+ * net; if the kernel refused the descriptor, we back off.
+ */
+static void
+fcgi_pause(struct env *env, int kernel)
+{
+	struct timeval		 tv;
+
+	if (kernel)
+		pause_ms = pause_ms == 0 ? PAUSE_MIN :
+		    MIN(pause_ms * 2, PAUSE_MAX);
+	tv.tv_sec = (kernel ? pause_ms : PAUSE_MAX) / 1000;
+	tv.tv_usec = (kernel ? pause_ms : PAUSE_MAX) % 1000 * 1000;
+
+	if (paused_env == NULL) {
+		stat_deferred++;
+		clock_gettime(CLOCK_MONOTONIC, &paused_since);
+		event_del(&env->env_sockev);
+		paused_env = env;
 	}
+	evtimer_add(&env->env_pausev, &tv);
+	log_debug("%s: deferring connections", __func__);
+}
+
+static void
+fcgi_resume(void)
+{
+	struct env		*env = paused_env;
+	struct timespec		 now;
+
+	if (env == NULL)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stat_paused_ns += (now.tv_sec - paused_since.tv_sec) * 1000000000ULL
+	    + now.tv_nsec - paused_since.tv_nsec;
+
+	paused_env = NULL;
+	evtimer_del(&env->env_pausev);
+	if (!env->env_draining && !aside)
+		event_add(&env->env_sockev, NULL);
+	log_debug("%s: accepting connections again", __func__);
+}
+
+/*
+ * In exclusive mode stop watching the socket while we have more
+ * connections than the average child, so that the others get to
+ * accept them, and start again once we're back to it.  One over is
+ * let go, or short connections would have us flap at every one.
+ * avg_load is INT_MAX until the parent tells it, hence the - 1.
+ */
+static void
+fcgi_balance(struct env *env)
+{
+	int			 over;
+
+	if (conf.cf_accept != ACCEPT_EXCLUSIVE || env->env_draining)
+		return;
+
+	over = fcgi_inflight - 1 > avg_load;
+	if (over == aside)
+		return;
+	aside = over;
+
+	if (aside)
+		stat_aside++;
+	if (paused_env != NULL)
+		return;
+	if (aside)
+		event_del(&env->env_sockev);
+	else
+		event_add(&env->env_sockev, NULL);
+}
+
+/*
+ * Tell the parent how busy we are, so that it can hand the next
+ * connection to the least loaded child, or tell the children how
+ * loaded the average one is.  A child out of descriptors is full.
+ */
+static void
+fcgi_report(struct env *env)
+{
+	if (conf.cf_accept != ACCEPT_SHARED)
+		ctl_send(CTL_LOAD, fcgi_fds_left() ? fcgi_inflight : INT_MAX);
+	fcgi_balance(env);
+}
+
+static void
+fcgi_inflight_dec(struct env *env, const char *why)
+{
+	fcgi_inflight--;
+	log_debug("%s: fcgi inflight decremented, now %d, %s",
+	    __func__, fcgi_inflight, why);
+	fcgi_report(env);
+
+	if (paused_env != NULL && fcgi_fds_left())
+		fcgi_resume();
+}
+
+/*
+ * Set up a new connection on s, already counted in fcgi_inflight.
+ */
+static void
+fcgi_conn(struct env *env, int s)
+{
+	struct fcgi		*fcgi;
 
 	if ((fcgi = calloc(1, sizeof(*fcgi))) == NULL)
 		goto err;
@@ -247,9 +639,7 @@ fcgi_accept(int fd, short event, void *arg)
 	fcgi->fcg_id = ++fcgi_id;
 	fcgi->fcg_s = s;
 	fcgi->fcg_env = env;
-	fcgi->fcg_want = FCGI_RECORD_HEADER;
-	fcgi->fcg_toread = sizeof(struct fcgi_header);
-	SPLAY_INIT(&fcgi->fcg_clients);
+	TAILQ_INIT(&fcgi->fcg_suspended);
 
 	/* assume it's enabled until we get a FCGI_BEGIN_REQUEST */
 	fcgi->fcg_keep_conn = 1;
@@ -259,222 +649,685 @@ fcgi_accept(int fd, short event, void *arg)
 	if (fcgi->fcg_bev == NULL)
 		goto err;
 
+	/* get called back to resume the suspended clients */
+	bufferevent_setwatermark(fcgi->fcg_bev, EV_WRITE, CLT_LOWAT, 0);
+
 	bufferevent_enable(fcgi->fcg_bev, EV_READ | EV_WRITE);
+	SPLAY_INSERT(fcgi_tree, &env->env_fcgi_socks, fcgi);
+	fcgi_report(env);
 	return;
 
 err:
-	if (s != -1) {
-		close(s);
-		free(fcgi);
-		fcgi_inflight_dec(__func__);
-	}
+	close(s);
+	free(fcgi);
+	fcgi_inflight_dec(env, __func__);
 }
 
-static int
-parse_len(struct fcgi *fcgi, struct evbuffer *src)
+void
+fcgi_accept(int fd, short event, void *arg)
 {
-	unsigned char		 c, x[3];
+	struct env		*env = arg;
+	socklen_t		 slen;
+	struct sockaddr_storage	 ss;
+	int			 n, s = -1;
 
-	fcgi->fcg_toread--;
-	evbuffer_remove(src, &c, 1);
-	if (c >> 7 == 0)
-		return (c);
+	if ((event & EV_TIMEOUT))
+		fcgi_resume();
+	else
+		stat_wakeups++;
+
+	/* drain the backlog, but give the other events a chance too */
+	for (n = 0; n < ACCEPT_BATCH; ++n) {
+		if (!fcgi_fds_left()) {
+			fcgi_pause(env, 0);
+			break;
+		}
 
-	if (fcgi->fcg_toread < 3)
-		return (-1);
+		slen = sizeof(ss);
+		s = accept_reserve(env->env_sockfd, (struct sockaddr *)&ss,
+		    &slen, FD_RESERVE, &fcgi_inflight);
+		if (s != -1) {
+			stat_accepted++;
+			pause_ms = 0;
+			fcgi_conn(env, s);
+			if (aside)
+				break;
+			continue;
+		}
 
-	fcgi->fcg_toread -= 3;
-	evbuffer_remove(src, x, sizeof(x));
-	return (((c & 0x7F) << 24) | (x[0] << 16) | (x[1] << 8) | x[2]);
+		/*
+		 * Pause accept if we are out of file descriptors, or
+		 * libevent will haunt us here too.
+		 */
+		if (errno == ENFILE || errno == EMFILE)
+			fcgi_pause(env, 1);
+		else if (errno == ECONNABORTED)
+			stat_refused++;
+		else if (errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR)
+			log_warn("%s: accept", __func__);
+		break;
+	}
 }
 
-static int
-fcgi_parse_params(struct fcgi *fcgi, struct evbuffer *src, struct client *clt)
-{
-	char			 pname[32];
-	char			 server[HOST_NAME_MAX + 1];
-	char			 path[PATH_MAX];
-	char			 query[GEMINI_MAXLEN];
-	char			 method[8];
-	int			 nlen, vlen;
-
-	while (fcgi->fcg_toread > 0) {
-		if ((nlen = parse_len(fcgi, src)) < 0 ||
-		    (vlen = parse_len(fcgi, src)) < 0)
-			return (-1);
+/*
+ * Read the messages of the parent process, and the connections it
+ * accepted for us in dispatch mode.
+ */
+void
+fcgi_recv(int fd, short event, void *arg)
+{
+	struct env		*env = arg;
+	struct ctl_msg		 msg;
+	struct msghdr		 mh;
+	struct cmsghdr		*cmsg;
+	struct iovec		 iov;
+	union {
+		struct cmsghdr	 hdr;
+		char		 buf[CMSG_SPACE(sizeof(int))];
+	}			 cmsgbuf;
+	ssize_t			 n;
+	int			 i, s;
+
+	stat_wakeups++;
+
+	for (i = 0; i < ACCEPT_BATCH; ++i) {
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = &msg;
+		iov.iov_len = sizeof(msg);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = &cmsgbuf.buf;
+		mh.msg_controllen = sizeof(cmsgbuf.buf);
+
+		if ((n = recvmsg(fd, &mh, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				log_warn("%s: recvmsg", __func__);
+			return;
+		}
+		if (n == 0)
+			fatalx("%s: parent process went away", __func__);
+
+		s = -1;
+		for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SCM_RIGHTS)
+				memcpy(&s, CMSG_DATA(cmsg), sizeof(s));
+		}
 
-		if (fcgi->fcg_toread < nlen + vlen)
-			return (-1);
+		if (n != sizeof(msg) || (msg.m_type != CTL_CONN &&
+		    msg.m_type != CTL_RETIRE && msg.m_type != CTL_IMAGE &&
+		    msg.m_type != CTL_AVGLOAD)) {
+			log_warnx("%s: unexpected message", __func__);
+			if (s != -1)
+				close(s);
+			continue;
+		}
 
-		if ((size_t)nlen > sizeof(pname) - 1) {
-			/* ignore this parameter */
-			fcgi->fcg_toread -= nlen - vlen;
-			evbuffer_drain(src, nlen + vlen);
+		if (msg.m_type == CTL_RETIRE) {
+			if (s != -1)
+				close(s);
+			server_drain(env);
 			continue;
 		}
 
-		fcgi->fcg_toread -= nlen;
-		evbuffer_remove(src, &pname, nlen);
-		pname[nlen] = '\0';
+		if (msg.m_type == CTL_AVGLOAD) {
+			if (s != -1)
+				close(s);
+			avg_load = msg.m_value;
+			fcgi_balance(env);
+			continue;
+		}
 
-		if (!strcmp(pname, "SERVER_NAME") &&
-		    (size_t)vlen < sizeof(server)) {
-			fcgi->fcg_toread -= vlen;
-			evbuffer_remove(src, &server, vlen);
-			server[vlen] = '\0';
+		if (msg.m_type == CTL_IMAGE) {
+			if ((mh.msg_flags & MSG_CTRUNC) || s == -1) {
+				log_warnx("%s: lost the db image", __func__);
+				if (s != -1)
+					close(s);
+				ctl_send(CTL_RELOADED, -1);
+			} else
+				server_image(env, s);
+			continue;
+		}
 
-			free(clt->clt_server_name);
-			if ((clt->clt_server_name = strdup(server)) == NULL)
-				return (-1);
-			DPRINTF("clt %d: server_name: %s", clt->clt_id,
-			    clt->clt_server_name);
+		if ((mh.msg_flags & MSG_CTRUNC) || s == -1) {
+			log_warnx("%s: lost a connection", __func__);
+			if (s != -1)
+				close(s);
+			continue;
+		}
+
+		/*
+		 * We told the parent we're full, but it sent this one
+		 * before hearing it.  Say it again, it also takes back
+		 * the connection it counted.
+		 */
+		if (!fcgi_fds_left()) {
+			log_warnx("%s: out of file descriptors, dropping"
+			    " connection", __func__);
+			stat_refused++;
+			close(s);
+			fcgi_report(env);
 			continue;
 		}
 
-		if (!strcmp(pname, "SCRIPT_NAME") &&
-		    (size_t)vlen < sizeof(path)) {
-			fcgi->fcg_toread -= vlen;
-			evbuffer_remove(src, &path, vlen);
-			path[vlen] = '\0';
+		stat_accepted++;
+		fcgi_inflight++;
+		fcgi_conn(env, s);
+	}
+}
 
-			free(clt->clt_script_name);
-			clt->clt_script_name = strdup(path);
-			if (clt->clt_script_name == NULL)
-				return (-1);
+/*
+ * No requests in progress and every reply went out.
+ */
+int
+fcgi_idle(struct env *env)
+{
+	struct fcgi		*fcgi;
+	struct evbuffer		*out;
 
-			DPRINTF("clt %d: script_name: %s", clt->clt_id,
-			    clt->clt_script_name);
-			continue;
+	if (fcgi_nclients > 0)
+		return (0);
+
+	SPLAY_FOREACH(fcgi, fcgi_tree, &env->env_fcgi_socks) {
+		out = EVBUFFER_OUTPUT(fcgi->fcg_bev);
+		if (EVBUFFER_LENGTH(out) > 0)
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Give up on the requests still in progress, so the frontend gets an
+ * FCGI_END_REQUEST for each of them instead of a closed connection.
+ */
+int
+fcgi_end_all(struct env *env)
+{
+	struct fcgi		*fcgi, *next;
+	struct client		*clt;
+	size_t			 i;
+	int			 n = 0;
+
+	for (fcgi = SPLAY_MIN(fcgi_tree, &env->env_fcgi_socks);
+	    fcgi != NULL; fcgi = next) {
+		next = SPLAY_NEXT(fcgi_tree, &env->env_fcgi_socks, fcgi);
+		for (i = 0; i < fcgi->fcg_maxclients; ++i) {
+			if ((clt = fcgi->fcg_clients[i]) == NULL)
+				continue;
+			n++;
+			if (fcgi_abort_request(clt) == -1)
+				break;	/* fcgi was freed */
+		}
+	}
+	return (n);
+}
+
+/*
+ * Have every connection closed once its last request is done, and
+ * close the idle ones right away.
+ */
+void
+fcgi_drain(struct env *env)
+{
+	struct fcgi		*fcgi, *next;
+
+	for (fcgi = SPLAY_MIN(fcgi_tree, &env->env_fcgi_socks);
+	    fcgi != NULL; fcgi = next) {
+		next = SPLAY_NEXT(fcgi_tree, &env->env_fcgi_socks, fcgi);
+		fcgi->fcg_keep_conn = 0;
+		if (fcgi->fcg_nclients == 0) {
+			fcgi->fcg_done = 1;
+			fcgi_write(fcgi->fcg_bev, fcgi);
 		}
+	}
+}
+
+/*
+ * Decode a name or value length at *p, one or four bytes long.
+ */
+static int
+parse_len(const uint8_t **p, const uint8_t *end)
+{
+	const uint8_t		*s = *p;
 
-		if (!strcmp(pname, "PATH_INFO") &&
-		    (size_t)vlen < sizeof(path)) {
-			fcgi->fcg_toread -= vlen;
-			evbuffer_remove(src, &path, vlen);
-			path[vlen] = '\0';
+	if (end - s < 1)
+		return (-1);
 
-			free(clt->clt_path_info);
-			clt->clt_path_info = strdup(path);
-			if (clt->clt_path_info == NULL)
-				return (-1);
+	if (*s >> 7 == 0) {
+		*p = s + 1;
+		return (*s);
+	}
 
-			DPRINTF("clt %d: path_info: %s", clt->clt_id,
-			    clt->clt_path_info);
-			continue;
+	if (end - s < 4)
+		return (-1);
+
+	*p = s + 4;
+	return (((s[0] & 0x7F) << 24) | (s[1] << 16) | (s[2] << 8) | s[3]);
+}
+
+/*
+ * Get the next name-value pair from the record body in [*p, end).
+ * Names and values are left in place and are not NUL-terminated.
+ */
+static int
+parse_pair(const uint8_t **p, const uint8_t *end, const char **name,
+    size_t *nlen, const char **val, size_t *vlen)
+{
+	int			 n, v;
+
+	if ((n = parse_len(p, end)) == -1 || (v = parse_len(p, end)) == -1)
+		return (-1);
+
+	if ((size_t)(end - *p) < (size_t)n + v)
+		return (-1);
+
+	*name = (const char *)*p;
+	*nlen = n;
+	*val = *name + n;
+	*vlen = v;
+	*p += n + v;
+	return (0);
+}
+
+#define PARAM_IS(n, l, s)	((l) == sizeof(s) - 1 && !memcmp(n, s, l))
+
+/*
+ * FCGI_PARAMS is a stream of name-value pairs that can be split
+ * anywhere across records, so every client keeps a small parser
+ * state.  Values we're interested in are copied straight to their
+ * final place in the arena as they arrive, the rest is skipped.
+ */
+
+enum {
+	PARAM_NLEN,
+	PARAM_VLEN,
+	PARAM_NAME,
+	PARAM_VALUE,
+};
+
+enum {
+	P_SERVER_NAME,
+	P_SCRIPT_NAME,
+	P_PATH_INFO,
+	P_QUERY_STRING,
+	P_REQUEST_METHOD,
+
+	/* the ones given with -e follow */
+	P_EXTRA,
+};
+
+static const struct {
+	const char	*name;
+	size_t		 maxlen;	/* values must be shorter */
+} params[] = {
+	[P_SERVER_NAME] =	{ "SERVER_NAME",	HOST_NAME_MAX + 1 },
+	[P_SCRIPT_NAME] =	{ "SCRIPT_NAME",	PATH_MAX },
+	[P_PATH_INFO] =		{ "PATH_INFO",		PATH_MAX },
+	[P_QUERY_STRING] =	{ "QUERY_STRING",	GEMINI_MAXLEN },
+	[P_REQUEST_METHOD] =	{ "REQUEST_METHOD",	8 },
+};
+
+/*
+ * Map a parameter name to one of the above, looking only at its
+ * length and first bytes before confirming with a single memcmp.
+ * The few extra ones configured are tried last.
+ */
+static int
+param_lookup(const char *name, size_t len)
+{
+	int			 p;
+
+	if (len == 0 || len > 0xFF)
+		return (-1);
+
+	switch (len << 8 | (unsigned char)name[0]) {
+	case 9 << 8 | 'P':
+		p = P_PATH_INFO;
+		break;
+	case 11 << 8 | 'S':
+		p = name[1] == 'E' ? P_SERVER_NAME : P_SCRIPT_NAME;
+		break;
+	case 12 << 8 | 'Q':
+		p = P_QUERY_STRING;
+		break;
+	case 14 << 8 | 'R':
+		p = P_REQUEST_METHOD;
+		break;
+	default:
+		goto extra;
+	}
+
+	if (memcmp(name, params[p].name, len) == 0)
+		return (p);
+
+ extra:
+	for (p = 0; p < conf.cf_nparams; ++p)
+		if (strlen(conf.cf_params[p]) == len &&
+		    memcmp(name, conf.cf_params[p], len) == 0)
+			return (P_EXTRA + p);
+	return (-1);
+}
+
+static void
+param_start(struct client *clt)
+{
+	size_t			 maxlen;
+	int			 p;
+
+	clt->clt_pparam = -1;
+	if (clt->clt_pnlen >= sizeof(clt->clt_pname))
+		return;
+
+	if ((p = param_lookup(clt->clt_pname, clt->clt_pnlen)) == -1)
+		return;
+	maxlen = p >= P_EXTRA ? GEMINI_MAXLEN : params[p].maxlen;
+	if (clt->clt_pvlen >= maxlen ||
+	    (p == P_QUERY_STRING && clt->clt_pvlen == 0))
+		return;
+	clt->clt_pparam = p;
+}
+
+static void
+param_done(struct client *clt)
+{
+	char			*val = clt->clt_pval;
+	char			**dst = NULL;
+
+	val[clt->clt_pvlen] = '\0';
+	clt->clt_pval = NULL;
+
+	DPRINTF("clt %d: %s: %s", clt->clt_id, clt->clt_pparam >= P_EXTRA ?
+	    conf.cf_params[clt->clt_pparam - P_EXTRA] :
+	    params[clt->clt_pparam].name, val);
+
+	switch (clt->clt_pparam) {
+	case P_SERVER_NAME:
+		dst = &clt->clt_server_name;
+		break;
+	case P_SCRIPT_NAME:
+		dst = &clt->clt_script_name;
+		break;
+	case P_PATH_INFO:
+		dst = &clt->clt_path_info;
+		break;
+	case P_QUERY_STRING:
+		dst = &clt->clt_query;
+		break;
+	case P_REQUEST_METHOD:
+		if (!strcasecmp(val, "GET"))
+			clt->clt_method = METHOD_GET;
+		if (!strcasecmp(val, "POST"))
+			clt->clt_method = METHOD_POST;
+		clt_strfree(clt, val);
+		return;
+	default:
+		dst = &clt->clt_params[clt->clt_pparam - P_EXTRA];
+		break;
+	}
+
+	clt_strfree(clt, *dst);
+	*dst = val;
+}
+
+/*
+ * Feed the next chunk of the FCGI_PARAMS stream to the client.
+ */
+static int
+fcgi_parse_params(struct client *clt, const uint8_t *p, const uint8_t *end)
+{
+	uint8_t			*l = clt->clt_plen;
+	size_t			 n, len;
+
+	for (;;) {
+		switch (clt->clt_pstate) {
+		case PARAM_NLEN:
+		case PARAM_VLEN:
+			if (p == end)
+				return (0);
+			l[clt->clt_plenpos++] = *p++;
+			if (l[0] >> 7 && clt->clt_plenpos < 4)
+				break;
+
+			if (clt->clt_plenpos == 1)
+				len = l[0];
+			else
+				len = ((l[0] & 0x7F) << 24) | (l[1] << 16) |
+				    (l[2] << 8) | l[3];
+			clt->clt_plenpos = 0;
+			clt->clt_ppos = 0;
+
+			if (clt->clt_pstate == PARAM_NLEN) {
+				clt->clt_pnlen = len;
+				clt->clt_pstate = PARAM_VLEN;
+			} else {
+				clt->clt_pvlen = len;
+				clt->clt_pstate = PARAM_NAME;
+			}
+			break;
+		case PARAM_NAME:
+			n = MIN((size_t)(end - p),
+			    clt->clt_pnlen - clt->clt_ppos);
+			if (clt->clt_ppos + n < sizeof(clt->clt_pname))
+				memcpy(&clt->clt_pname[clt->clt_ppos], p, n);
+			clt->clt_ppos += n;
+			p += n;
+			if (clt->clt_ppos < clt->clt_pnlen)
+				return (0);
+
+			param_start(clt);
+			if (clt->clt_pparam != -1) {
+				clt->clt_pval = clt_stralloc(clt,
+				    clt->clt_pvlen + 1);
+				if (clt->clt_pval == NULL)
+					return (-1);
+			}
+			clt->clt_ppos = 0;
+			clt->clt_pstate = PARAM_VALUE;
+			break;
+		case PARAM_VALUE:
+			n = MIN((size_t)(end - p),
+			    clt->clt_pvlen - clt->clt_ppos);
+			if (clt->clt_pval != NULL)
+				memcpy(&clt->clt_pval[clt->clt_ppos], p, n);
+			clt->clt_ppos += n;
+			p += n;
+			if (clt->clt_ppos < clt->clt_pvlen)
+				return (0);
+
+			if (clt->clt_pval != NULL)
+				param_done(clt);
+			clt->clt_pstate = PARAM_NLEN;
+			break;
 		}
+	}
+}
 
-		if (!strcmp(pname, "QUERY_STRING") &&
-		    (size_t)vlen < sizeof(query) &&
-		    vlen > 0) {
-			fcgi->fcg_toread -= vlen;
-			evbuffer_remove(src, &query, vlen);
-			query[vlen] = '\0';
+/*
+ * The most connections accept_reserve lets in: every connection
+ * takes a descriptor and is counted again as inflight.
+ */
+static int
+fcgi_max_conns(void)
+{
+	int			 base;
 
-			free(clt->clt_query);
-			if ((clt->clt_query = strdup(query)) == NULL)
-				return (-1);
+	base = fd_count() - fcgi_inflight;
+	return ((getdtablesize() - base - FD_RESERVE) / 2);
+}
+
+/*
+ * The most requests that are let in: a frontend that doesn't
+ * multiplex needs a connection for each of them.
+ */
+static int
+fcgi_max_reqs(void)
+{
+	return (MIN(fcgi_max_conns(), MAX_REQUESTS));
+}
 
-			DPRINTF("clt %d: query: %s", clt->clt_id,
-			    clt->clt_query);
+/*
+ * Reply to a FCGI_GET_VALUES management record.  Variables we don't
+ * know about are left out of the reply, as the spec mandates.
+ */
+static int
+fcgi_get_values(struct fcgi *fcgi, const uint8_t *p, const uint8_t *end)
+{
+	const char		*name, *v;
+	char			 val[16];
+	unsigned char		 res[128];
+	size_t			 len = 0, nlen, vlen;
+	int			 n;
+
+	while (p < end) {
+		if (parse_pair(&p, end, &name, &nlen, &v, &vlen) == -1)
+			return (-1);
+
+		if (PARAM_IS(name, nlen, FCGI_MAX_CONNS))
+			n = fcgi_max_conns();
+		else if (PARAM_IS(name, nlen, FCGI_MAX_REQS))
+			n = fcgi_max_reqs();
+		else if (PARAM_IS(name, nlen, FCGI_MPXS_CONNS))
+			n = 1;
+		else
 			continue;
-		}
 
-		if (!strcmp(pname, "REQUEST_METHOD") &&
-		    (size_t)vlen < sizeof(method)) {
-			fcgi->fcg_toread -= vlen;
-			evbuffer_remove(src, &method, vlen);
-			method[vlen] = '\0';
+		vlen = snprintf(val, sizeof(val), "%d", n);
+		if (len + 2 + nlen + vlen > sizeof(res))
+			continue;
+
+		res[len++] = nlen;
+		res[len++] = vlen;
+		memcpy(&res[len], name, nlen);
+		len += nlen;
+		memcpy(&res[len], val, vlen);
+		len += vlen;
+	}
 
-			if (!strcasecmp(method, "GET"))
-				clt->clt_method = METHOD_GET;
-			if (!strcasecmp(method, "POST"))
-				clt->clt_method = METHOD_POST;
+	return (fcgi_send_record(fcgi, FCGI_GET_VALUES_RESULT, 0, res, len));
+}
 
-			continue;
+/*
+ * Consume what is buffered of the current FCGI_PARAMS record.
+ */
+static int
+fcgi_read_params(struct fcgi *fcgi, struct evbuffer *src)
+{
+	struct client		*clt;
+	const uint8_t		*data;
+	size_t			 n;
+
+	n = MIN(EVBUFFER_LENGTH(src), fcgi->fcg_params_left);
+	if (n > 0) {
+		data = evbuffer_pullup(src, n);
+		clt = fcgi_client_find(fcgi, fcgi->fcg_params_id);
+		if (clt == NULL)
+			log_warnx("got FCGI_PARAMS for inactive id (%d)",
+			    fcgi->fcg_params_id);
+		else if (clt->clt_pdone)
+			log_warnx("got FCGI_PARAMS after the end of the"
+			    " stream for id %d", fcgi->fcg_params_id);
+		else if (fcgi_parse_params(clt, data, data + n) == -1) {
+			log_warnx("fcgi_parse_params failed");
+			return (-1);
 		}
-
-		fcgi->fcg_toread -= vlen;
-		evbuffer_drain(src, vlen);
+		evbuffer_drain(src, n);
+		fcgi->fcg_params_left -= n;
 	}
 
+	n = MIN(EVBUFFER_LENGTH(src), fcgi->fcg_params_pad);
+	evbuffer_drain(src, n);
+	fcgi->fcg_params_pad -= n;
 	return (0);
 }
 
+/*
+ * Records are parsed in place once they're fully buffered, so that
+ * no copy is needed, and then drained all at once.  The exception
+ * are FCGI_PARAMS whose body is fed to the client as it arrives.
+ * Only the record at hand is made contiguous, not the whole input.
+ */
 void
 fcgi_read(struct bufferevent *bev, void *d)
 {
 	struct fcgi		*fcgi = d;
 	struct env		*env = fcgi->fcg_env;
 	struct evbuffer		*src = EVBUFFER_INPUT(bev);
-	struct fcgi_header	 hdr;
-	struct fcgi_begin_req	 breq;
-	struct client		*clt, q;
-	int			 role;
-
-	memset(&q, 0, sizeof(q));
+	struct fcgi_header	*hdr;
+	struct fcgi_begin_req	*breq;
+	struct fcgi_unknown_type_body unk;
+	struct client		*clt;
+	const uint8_t		*body, *end;
+	size_t			 len;
+	int			 id, role;
 
 	for (;;) {
-		if (EVBUFFER_LENGTH(src) < (size_t)fcgi->fcg_toread)
-			return;
-
-		if (fcgi->fcg_want == FCGI_RECORD_HEADER) {
-			fcgi->fcg_want = FCGI_RECORD_BODY;
-			bufferevent_read(bev, &hdr, sizeof(hdr));
-
-			DPRINTF("header: v=%d t=%d id=%d len=%d p=%d",
-			    hdr.version, hdr.type,
-			    CAT(hdr.req_id0, hdr.req_id1),
-			    CAT(hdr.content_len0, hdr.content_len1),
-			    hdr.padding);
-
-			if (hdr.version != FCGI_VERSION_1) {
-				log_warnx("unknown fastcgi version: %d",
-				    hdr.version);
+		if (fcgi->fcg_params_left > 0 || fcgi->fcg_params_pad > 0) {
+			if (fcgi_read_params(fcgi, src) == -1) {
 				fcgi_error(bev, EV_READ, d);
 				return;
 			}
-
-			fcgi->fcg_toread = CAT(hdr.content_len0,
-			    hdr.content_len1);
-			if (fcgi->fcg_toread < 0) {
-				log_warnx("invalid record length: %d",
-				    fcgi->fcg_toread);
-				fcgi_error(bev, EV_READ, d);
+			if (fcgi->fcg_params_left > 0 ||
+			    fcgi->fcg_params_pad > 0)
 				return;
-			}
+			continue;
+		}
 
-			fcgi->fcg_padding = hdr.padding;
-			if (fcgi->fcg_padding < 0) {
-				log_warnx("invalid padding: %d",
-				    fcgi->fcg_padding);
-				fcgi_error(bev, EV_READ, d);
-				return;
-			}
+		if (EVBUFFER_LENGTH(src) < sizeof(*hdr))
+			return;
+
+		hdr = (struct fcgi_header *)evbuffer_pullup(src,
+		    sizeof(*hdr));
+		if (hdr->version != FCGI_VERSION_1) {
+			log_warnx("unknown fastcgi version: %d",
+			    hdr->version);
+			fcgi_error(bev, EV_READ, d);
+			return;
+		}
 
-			fcgi->fcg_type = hdr.type;
-			fcgi->fcg_rec_id = CAT(hdr.req_id0, hdr.req_id1);
+		len = CAT(hdr->content_len0, hdr->content_len1);
+		id = CAT(hdr->req_id0, hdr->req_id1);
+
+		if (hdr->type == FCGI_PARAMS && len > 0) {
+			fcgi->fcg_params_id = id;
+			fcgi->fcg_params_left = len;
+			fcgi->fcg_params_pad = hdr->padding;
+			evbuffer_drain(src, sizeof(*hdr));
 			continue;
 		}
 
-		q.clt_id = fcgi->fcg_rec_id;
-		clt = SPLAY_FIND(client_tree, &fcgi->fcg_clients, &q);
+		if (EVBUFFER_LENGTH(src) < sizeof(*hdr) + len + hdr->padding)
+			return;
+		hdr = (struct fcgi_header *)evbuffer_pullup(src,
+		    sizeof(*hdr) + len + hdr->padding);
+
+		body = (const uint8_t *)(hdr + 1);
+		end = body + len;
+
+		DPRINTF("header: v=%d t=%d id=%d len=%zu p=%d",
+		    hdr->version, hdr->type, id, len, hdr->padding);
 
-		switch (fcgi->fcg_type) {
+		clt = fcgi_client_find(fcgi, id);
+
+		switch (hdr->type) {
 		case FCGI_BEGIN_REQUEST:
-			if (sizeof(breq) != fcgi->fcg_toread) {
+			if (sizeof(*breq) != len) {
 				log_warnx("unexpected size for "
 				    "FCGI_BEGIN_REQUEST");
 				fcgi_error(bev, EV_READ, d);
 				return;
 			}
 
-			evbuffer_remove(src, &breq, sizeof(breq));
+			breq = (struct fcgi_begin_req *)body;
 
-			role = CAT(breq.role0, breq.role1);
+			role = CAT(breq->role0, breq->role1);
 			if (role != FCGI_RESPONDER) {
 				log_warnx("unknown fastcgi role: %d",
 				    role);
-				if (fcgi_send_end_req(fcgi, fcgi->fcg_rec_id,
+				if (fcgi_send_end_req(fcgi, id,
 				    1, FCGI_UNKNOWN_ROLE) == -1) {
 					fcgi_error(bev, EV_READ, d);
 					return;
@@ -482,68 +1335,102 @@ fcgi_read(struct bufferevent *bev, void *d)
 				break;
 			}
 
+			if (env->env_draining) {
+				log_debug("draining, rejecting %d", id);
+				if (fcgi_send_end_req(fcgi, id,
+				    1, FCGI_OVERLOADED) == -1) {
+					fcgi_error(bev, EV_READ, d);
+					return;
+				}
+				if (fcgi->fcg_nclients == 0)
+					fcgi->fcg_done = 1;
+				break;
+			}
+
 			if (!fcgi->fcg_keep_conn) {
 				log_warnx("trying to reuse the fastcgi "
 				    "socket without marking it as so.");
 				fcgi_error(bev, EV_READ, d);
 				return;
 			}
-			fcgi->fcg_keep_conn = breq.flags & FCGI_KEEP_CONN;
+			fcgi->fcg_keep_conn = breq->flags & FCGI_KEEP_CONN;
 
 			if (clt != NULL) {
 				log_warnx("ignoring attemp to re-use an "
-				    "active request id (%d)",
-				    fcgi->fcg_rec_id);
+				    "active request id (%d)", id);
+				break;
+			}
+
+			/* id 0 is reserved for the management records */
+			if (fcgi_nclients >= MAX_REQUESTS ||
+			    id == 0 || id > MAX_REQUESTS) {
+				log_debug("too many requests or bad id,"
+				    " rejecting %d", id);
+				if (fcgi_send_end_req(fcgi, id,
+				    1, FCGI_OVERLOADED) == -1) {
+					fcgi_error(bev, EV_READ, d);
+					return;
+				}
 				break;
 			}
 
-			if ((clt = calloc(1, sizeof(*clt))) == NULL) {
-				log_warnx("calloc");
+			if ((clt = clt_alloc()) == NULL) {
+				log_warn("malloc");
 				break;
 			}
 
 #if template
 			clt->clt_tp = template(clt, clt_tp_puts, clt_tp_putc);
 			if (clt->clt_tp == NULL) {
-				free(clt);
+				clt_recycle(clt);
 				log_warn("template");
 				break;
 			}
 #endif
 
-			clt->clt_id = fcgi->fcg_rec_id;
+			clt->clt_id = id;
 			clt->clt_fd = -1;
 			clt->clt_fcgi = fcgi;
-			SPLAY_INSERT(client_tree, &fcgi->fcg_clients, clt);
+			if (fcgi_client_insert(fcgi, clt) == -1) {
+				log_warn("recallocarray");
+				server_client_free(clt);
+				clt_recycle(clt);
+				break;
+			}
+			fcgi->fcg_nclients++;
+			fcgi_nclients++;
 			break;
 		case FCGI_PARAMS:
 			if (clt == NULL) {
 				log_warnx("got FCGI_PARAMS for inactive id "
-				    "(%d)", fcgi->fcg_rec_id);
-				evbuffer_drain(src, fcgi->fcg_toread);
+				    "(%d)", id);
 				break;
 			}
-			if (fcgi->fcg_toread == 0) {
-				evbuffer_drain(src, fcgi->fcg_toread);
-				if (server_handle(env, clt) == -1)
-					return;
-				break;
+			/* the empty record ends the stream */
+			evbuffer_drain(src, sizeof(*hdr) + hdr->padding);
+			if (clt->clt_pdone) {
+				log_warnx("got FCGI_PARAMS after the end of"
+				    " the stream for id %d", id);
+				continue;
 			}
-			if (fcgi_parse_params(fcgi, src, clt) == -1) {
-				log_warnx("fcgi_parse_params failed");
+			if (clt->clt_pstate != PARAM_NLEN ||
+			    clt->clt_plenpos != 0) {
+				log_warnx("truncated FCGI_PARAMS for id %d",
+				    id);
 				fcgi_error(bev, EV_READ, d);
 				return;
 			}
-			break;
+			clt->clt_pdone = 1;
+			if (server_handle(env, clt) == -1)
+				return;
+			continue;
 		case FCGI_STDIN:
 			/* not interested in reading stdin */
-			evbuffer_drain(src, fcgi->fcg_toread);
 			break;
 		case FCGI_ABORT_REQUEST:
 			if (clt == NULL) {
 				log_warnx("got FCGI_ABORT_REQUEST for inactive"
-				    " id (%d)", fcgi->fcg_rec_id);
-				evbuffer_drain(src, fcgi->fcg_toread);
+				    " id (%d)", id);
 				break;
 			}
 			if (fcgi_end_request(clt, 1) == -1) {
@@ -551,17 +1438,37 @@ fcgi_read(struct bufferevent *bev, void *d)
 				return;
 			}
 			break;
+		case FCGI_GET_VALUES:
+			if (id != 0) {
+				log_warnx("got FCGI_GET_VALUES for request"
+				    " id %d", id);
+				break;
+			}
+			if (fcgi_get_values(fcgi, body, end) == -1) {
+				log_warnx("fcgi_get_values failed");
+				fcgi_error(bev, EV_READ, d);
+				return;
+			}
+			break;
 		default:
 			log_warnx("unknown fastcgi record type %d",
-			    fcgi->fcg_type);
-			evbuffer_drain(src, fcgi->fcg_toread);
+			    hdr->type);
+
+			/* management records must be answered */
+			if (id == 0) {
+				memset(&unk, 0, sizeof(unk));
+				unk.type = hdr->type;
+				if (fcgi_send_record(fcgi, FCGI_UNKNOWN_TYPE,
+				    0, &unk, sizeof(unk)) == -1) {
+					fcgi_error(bev, EV_READ, d);
+					return;
+				}
+			}
 			break;
 		}
 
-		/* Prepare for the next record. */
-		evbuffer_drain(src, fcgi->fcg_padding);
-		fcgi->fcg_want = FCGI_RECORD_HEADER;
-		fcgi->fcg_toread = sizeof(struct fcgi_header);
+		/* Done with this record, move to the next one. */
+		evbuffer_drain(src, sizeof(*hdr) + len + hdr->padding);
 	}
 }
 
@@ -570,6 +1477,17 @@ fcgi_write(struct bufferevent *bev, void *d)
 {
 	struct fcgi		*fcgi = d;
 	struct evbuffer		*out = EVBUFFER_OUTPUT(bev);
+	struct client		*clt;
+	route_t			 fn;
+
+	while ((clt = TAILQ_FIRST(&fcgi->fcg_suspended)) != NULL &&
+	    EVBUFFER_LENGTH(out) < CLT_HIWAT) {
+		TAILQ_REMOVE(&fcgi->fcg_suspended, clt, clt_entry);
+		fn = clt->clt_resume;
+		clt->clt_resume = NULL;
+		if (fn(fcgi->fcg_env, clt) == -1)
+			return;	/* fcgi was freed */
+	}
 
 	if (fcgi->fcg_done && EVBUFFER_LENGTH(out) == 0)
 		fcgi_error(bev, EVBUFFER_EOF, fcgi);
@@ -581,14 +1499,15 @@ fcgi_error(struct bufferevent *bev, short event, void *d)
 	struct fcgi		*fcgi = d;
 	struct env		*env = fcgi->fcg_env;
 	struct client		*clt;
+	size_t			 i;
 
 	log_debug("fcgi failure, shutting down connection (ev: %x)",
 	    event);
-	fcgi_inflight_dec(__func__);
+	fcgi_inflight_dec(env, __func__);
 
-	while ((clt = SPLAY_MIN(client_tree, &fcgi->fcg_clients)) != NULL) {
-		SPLAY_REMOVE(client_tree, &fcgi->fcg_clients, clt);
-		server_client_free(clt);
+	for (i = 0; i < fcgi->fcg_maxclients; ++i) {
+		if ((clt = fcgi->fcg_clients[i]) != NULL)
+			fcgi_client_free(fcgi, clt);
 	}
 
 	SPLAY_REMOVE(fcgi_tree, &env->env_fcgi_socks, fcgi);
@@ -602,49 +1521,214 @@ fcgi_free(struct fcgi *fcgi)
 {
 	close(fcgi->fcg_s);
 	bufferevent_free(fcgi->fcg_bev);
+	free(fcgi->fcg_clients);
 	free(fcgi);
 }
 
-int
-clt_flush(struct client *clt)
+/*
+ * Append len bytes to the recorded reply.  On failure the recording
+ * stops: it's not fatal, the reply just won't be cached.
+ */
+static void
+clt_rec_add(struct client *clt, const void *buf, size_t len)
+{
+	uint8_t			*rec;
+	size_t			 size;
+
+	if (clt->clt_cache == NULL)
+		return;
+
+	if (clt->clt_reclen + len > clt->clt_recsize) {
+		size = clt->clt_recsize == 0 ? RECORD_SIZE_MIN :
+		    clt->clt_recsize;
+		while (size < clt->clt_reclen + len)
+			size *= 2;
+		if ((rec = realloc(clt->clt_rec, size)) == NULL) {
+			log_warn("%s: realloc", __func__);
+			clt->clt_cache = NULL;
+			return;
+		}
+		clt->clt_rec = rec;
+		clt->clt_recsize = size;
+	}
+
+	memcpy(clt->clt_rec + clt->clt_reclen, buf, len);
+	clt->clt_reclen += len;
+}
+
+/*
+ * Frame len bytes of buf as a single FCGI_STDOUT record, and save it
+ * in clt_rec if the reply is being recorded.
+ */
+static int
+clt_record(struct client *clt, const uint8_t *buf, size_t len)
 {
+	static const uint8_t	 pad[8];
 	struct fcgi		*fcgi = clt->clt_fcgi;
 	struct bufferevent	*bev = fcgi->fcg_bev;
 	struct fcgi_header	 hdr;
 
-	if (clt->clt_buflen == 0)
-		return (0);
-
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.version = FCGI_VERSION_1;
 	hdr.type = FCGI_STDOUT;
 	hdr.req_id0 = (clt->clt_id & 0xFF);
 	hdr.req_id1 = (clt->clt_id >> 8);
-	hdr.content_len0 = (clt->clt_buflen & 0xFF);
-	hdr.content_len1 = (clt->clt_buflen >> 8);
+	hdr.content_len0 = (len & 0xFF);
+	hdr.content_len1 = (len >> 8);
+	/* keep records aligned to 8 bytes, as the spec recommends */
+	hdr.padding = -len & 7;
 
 	if (bufferevent_write(bev, &hdr, sizeof(hdr)) == -1 ||
-	    bufferevent_write(bev, clt->clt_buf, clt->clt_buflen) == -1) {
+	    bufferevent_write(bev, buf, len) == -1 ||
+	    bufferevent_write(bev, pad, hdr.padding) == -1) {
 		fcgi_error(bev, EV_WRITE, fcgi);
 		return (-1);
 	}
 
+	stat_records++;
+	clt->clt_output = 1;
+
+	clt_rec_add(clt, &hdr, sizeof(hdr));
+	clt_rec_add(clt, buf, len);
+	clt_rec_add(clt, pad, hdr.padding);
+
+	return (0);
+}
+
+int
+clt_flush(struct client *clt)
+{
+	if (clt->clt_buflen == 0)
+		return (0);
+
+	if (clt_record(clt, clt->clt_buf, clt->clt_buflen) == -1)
+		return (-1);
+
+	stat_staged += clt->clt_buflen;
 	clt->clt_buflen = 0;
 
 	return (0);
 }
 
+/*
+ * Send a series of already framed FCGI_STDOUT records, as saved
+ * from clt_rec.  The request id in every header is rewritten in
+ * place to match the client.
+ */
+int
+clt_write_records(struct client *clt, uint8_t *buf, size_t len)
+{
+	struct fcgi		*fcgi = clt->clt_fcgi;
+	struct bufferevent	*bev = fcgi->fcg_bev;
+	struct fcgi_header	*hdr;
+	size_t			 off;
+
+	if (clt_flush(clt) == -1)
+		return (-1);
+
+	for (off = 0; off + sizeof(*hdr) <= len;) {
+		hdr = (struct fcgi_header *)(buf + off);
+		hdr->req_id0 = (clt->clt_id & 0xFF);
+		hdr->req_id1 = (clt->clt_id >> 8);
+		off += sizeof(*hdr) + hdr->padding +
+		    CAT(hdr->content_len0, hdr->content_len1);
+		stat_records++;
+	}
+
+	if (bufferevent_write(bev, buf, len) == -1) {
+		fcgi_error(bev, EV_WRITE, fcgi);
+		return (-1);
+	}
+
+	clt->clt_output = 1;
+	stat_direct += len;
+	return (0);
+}
+
+/*
+ * Whether the client should stop producing output until the
+ * frontend reads what was already queued.
+ */
+int
+clt_congested(struct client *clt)
+{
+	struct evbuffer		*out = EVBUFFER_OUTPUT(clt->clt_fcgi->fcg_bev);
+
+	return (EVBUFFER_LENGTH(out) >= CLT_HIWAT);
+}
+
+/*
+ * Call fn to resume the client once the output buffer is drained
+ * below the low watermark.
+ */
+void
+clt_suspend(struct client *clt, route_t fn)
+{
+	struct fcgi		*fcgi = clt->clt_fcgi;
+
+	DPRINTF("clt %d: suspended", clt->clt_id);
+
+	clt->clt_resume = fn;
+	TAILQ_INSERT_TAIL(&fcgi->fcg_suspended, clt, clt_entry);
+}
+
+/*
+ * Make room in clt_buf for at least want bytes, without going past
+ * the maximum record size.  Replies start with a small buffer so
+ * that short ones stay cheap, and long ones use the fewest records.
+ */
+static int
+clt_grow(struct client *clt, size_t want)
+{
+	struct fcgi		*fcgi = clt->clt_fcgi;
+	char			*buf;
+	size_t			 size;
+
+	size = clt->clt_bufsize == 0 ? RECORD_SIZE_MIN : clt->clt_bufsize;
+	while (size < want && size < (size_t)conf.cf_recsize)
+		size *= 2;
+	size = MIN(size, (size_t)conf.cf_recsize);
+
+	if ((buf = realloc(clt->clt_buf, size)) == NULL) {
+		log_warn("%s: realloc", __func__);
+		fcgi_error(fcgi->fcg_bev, EV_WRITE, fcgi);
+		return (-1);
+	}
+
+	clt->clt_buf = buf;
+	clt->clt_bufsize = size;
+	return (0);
+}
+
 int
 clt_write(struct client *clt, const uint8_t *buf, size_t len)
 {
 	size_t			 left, copy;
 
 	while (len > 0) {
-		left = sizeof(clt->clt_buf) - clt->clt_buflen;
+		left = clt->clt_bufsize - clt->clt_buflen;
+
+		/*
+		 * Big chunks, like the DESCR and README of a port,
+		 * are sent as their own records straight from the
+		 * caller's memory rather than being copied through
+		 * clt_buf first.  Not only when they overflow it: once
+		 * clt_buf has grown, they'd fit and be copied twice.
+		 */
+		if (len >= CLT_DIRECT)
+			break;
+
+		if (len > left &&
+		    clt->clt_bufsize < (size_t)conf.cf_recsize) {
+			if (clt_grow(clt, clt->clt_buflen + len) == -1)
+				return (-1);
+			continue;
+		}
+
 		if (left == 0) {
 			if (clt_flush(clt) == -1)
 				return (-1);
-			left = sizeof(clt->clt_buf);
+			continue;
 		}
 
 		copy = MIN(left, len);
@@ -655,6 +1739,21 @@ clt_write(struct client *clt, const uint8_t *buf, size_t len)
 		len -= copy;
 	}
 
+	if (len == 0)
+		return (0);
+
+	if (clt_flush(clt) == -1)
+		return (-1);
+
+	while (len > 0) {
+		copy = MIN(len, (size_t)conf.cf_recsize);
+		if (clt_record(clt, buf, copy) == -1)
+			return (-1);
+		stat_direct += copy;
+		buf += copy;
+		len -= copy;
+	}
+
 	return (0);
 }
 
@@ -678,11 +1777,14 @@ clt_write_bufferevent(struct client *clt, struct bufferevent *bev)
 
 	len = EVBUFFER_LENGTH(src);
 	while (len > 0) {
-		left = sizeof(clt->clt_buf) - clt->clt_buflen;
+		left = clt->clt_bufsize - clt->clt_buflen;
 		if (left == 0) {
-			if (clt_flush(clt) == -1)
+			if (clt->clt_bufsize < (size_t)conf.cf_recsize) {
+				if (clt_grow(clt, clt->clt_bufsize + len) == -1)
+					return (-1);
+			} else if (clt_flush(clt) == -1)
 				return (-1);
-			left = sizeof(clt->clt_buf);
+			continue;
 		}
 
 		copy = bufferevent_read(bev, &clt->clt_buf[clt->clt_buflen],
@@ -695,18 +1797,108 @@ clt_write_bufferevent(struct client *clt, struct bufferevent *bev)
 	return (0);
 }
 
-int
-clt_printf(struct client *clt, const char *fmt, ...)
+/*
+ * Whether fmt only uses conversions that clt_vprintf_fast handles.
+ */
+static int
+fmt_simple(const char *fmt)
+{
+	while ((fmt = strchr(fmt, '%')) != NULL) {
+		if (fmt[1] != 's' && fmt[1] != 'd' && fmt[1] != '%')
+			return (0);
+		fmt += 2;
+	}
+
+	return (1);
+}
+
+static int
+clt_vprintf_fast(struct client *clt, const char *fmt, va_list ap)
+{
+	const char		*p, *str;
+	char			 num[16], *q;
+	unsigned int		 u;
+	int			 n, r = 0;
+
+	while ((p = strchr(fmt, '%')) != NULL) {
+		if (p != fmt && clt_write(clt, fmt, p - fmt) == -1)
+			return (-1);
+
+		switch (p[1]) {
+		case 's':
+			if ((str = va_arg(ap, const char *)) == NULL)
+				str = "(null)";
+			r = clt_puts(clt, str);
+			break;
+		case 'd':
+			n = va_arg(ap, int);
+			u = n < 0 ? -(unsigned int)n : (unsigned int)n;
+			q = num + sizeof(num);
+			do {
+				*--q = '0' + u % 10;
+			} while ((u /= 10) != 0);
+			if (n < 0)
+				*--q = '-';
+			r = clt_write(clt, q, num + sizeof(num) - q);
+			break;
+		case '%':
+			r = clt_putc(clt, '%');
+			break;
+		}
+		if (r == -1)
+			return (-1);
+
+		fmt = p + 2;
+	}
+
+	if (*fmt != '\0')
+		return (clt_puts(clt, fmt));
+	return (0);
+}
+
+/*
+ * Format straight into clt_buf, growing or flushing it when the
+ * output doesn't fit.  Only what is bigger than a whole record goes
+ * through a temporary allocation.
+ */
+static int
+clt_vprintf(struct client *clt, const char *fmt, va_list ap)
 {
 	struct fcgi		*fcgi = clt->clt_fcgi;
 	struct bufferevent	*bev = fcgi->fcg_bev;
+	va_list			 aq;
 	char			*str;
-	va_list			 ap;
+	size_t			 left, want;
 	int			 r;
 
-	va_start(ap, fmt);
+	for (;;) {
+		left = clt->clt_bufsize - clt->clt_buflen;
+
+		va_copy(aq, ap);
+		r = vsnprintf(clt->clt_buf + clt->clt_buflen, left, fmt, aq);
+		va_end(aq);
+		if (r < 0) {
+			fcgi_error(bev, EV_WRITE, fcgi);
+			return (-1);
+		}
+
+		if ((size_t)r < left) {
+			clt->clt_buflen += r;
+			return (0);
+		}
+
+		want = clt->clt_buflen + r + 1;
+		if (want <= (size_t)conf.cf_recsize) {
+			if (clt_grow(clt, want) == -1)
+				return (-1);
+		} else if (clt->clt_buflen > 0) {
+			if (clt_flush(clt) == -1)
+				return (-1);
+		} else
+			break;
+	}
+
 	r = vasprintf(&str, fmt, ap);
-	va_end(ap);
 	if (r == -1) {
 		fcgi_error(bev, EV_WRITE, fcgi);
 		return (-1);
@@ -717,6 +1909,22 @@ clt_printf(struct client *clt, const char *fmt, ...)
 	return (r);
 }
 
+int
+clt_printf(struct client *clt, const char *fmt, ...)
+{
+	va_list			 ap;
+	int			 r;
+
+	va_start(ap, fmt);
+	if (fmt_simple(fmt))
+		r = clt_vprintf_fast(clt, fmt, ap);
+	else
+		r = clt_vprintf(clt, fmt, ap);
+	va_end(ap);
+
+	return (r);
+}
+
 #if template
 int
 clt_tp_puts(struct template *tp, const char *str)
@@ -747,10 +1955,108 @@ fcgi_cmp(struct fcgi *a, struct fcgi *b)
 	return ((int)a->fcg_id - b->fcg_id);
 }
 
+void
+fcgi_stats(void)
+{
+	unsigned long long	 total;
+	double			 ratio = 0, avg = 0, batch = 0;
+	int			 nfds;
+
+	total = stat_staged + stat_direct;
+	if (total != 0)
+		ratio = 100.0 * stat_staged / total;
+	if (stat_replies != 0)
+		avg = (double)stat_records / stat_replies;
+	if (stat_wakeups != 0)
+		batch = (double)stat_accepted / stat_wakeups;
+
+	log_notice("output: %llu bytes staged in clt_buf, %llu bytes"
+	    " written directly (%.1f%% staged)", stat_staged, stat_direct,
+	    ratio);
+	log_notice("output: %llu replies, %llu records (%.1f records per"
+	    " reply)", stat_replies, stat_records, avg);
+	log_notice("clients: %llu allocated, %llu reused, %d pooled,"
+	    " %llu arena spills", stat_clt_alloc, stat_clt_reused, clt_npool,
+	    stat_arena_spills);
+	log_notice("accept: %llu connections in %llu wakeups (%.1f per"
+	    " wakeup), %llu deferred, %llu refused", stat_accepted,
+	    stat_wakeups, batch, stat_deferred, stat_refused);
+	log_notice("accept: paused for %.3fs%s", stat_paused_ns / 1e9,
+	    paused_env != NULL ? ", now paused" : "");
+	if (conf.cf_accept == ACCEPT_EXCLUSIVE)
+		log_notice("accept: stepped aside %llu times, average load"
+		    " %d%s", stat_aside, avg_load, aside ? ", now aside" : "");
+	nfds = fd_count();
+	log_notice("fds: %d in use of %d, %llu scans, %llu times off",
+	    nfds, getdtablesize(), stat_fd_scans, stat_fd_drift);
+}
+
+/*
+ * Count the open descriptors with a single poll(2) over the table up
+ * to a bit past fd_high: closed ones come back as POLLNVAL.  Unlike
+ * /proc this works inside the chroot too.  If one is found near the
+ * end, more could follow and the scan is done again further.
+ */
+static int
+fd_scan(void)
+{
+	struct pollfd	*pfd;
+	int		 i, lim, max, n, top;
+
+	max = getdtablesize();
+	for (;;) {
+		lim = MIN(max, fd_high + 1 + FD_SLACK);
+		if ((pfd = calloc(lim, sizeof(*pfd))) == NULL) {
+			log_warn("%s: calloc", __func__);
+			return (max);
+		}
+
+		for (i = 0; i < lim; ++i)
+			pfd[i].fd = i;
+		if (poll(pfd, lim, 0) == -1) {
+			log_warn("%s: poll", __func__);
+			free(pfd);
+			return (max);
+		}
+
+		n = 0;
+		top = -1;
+		for (i = 0; i < lim; ++i) {
+			if (!(pfd[i].revents & POLLNVAL)) {
+				n++;
+				top = i;
+			}
+		}
+		free(pfd);
+		stat_fd_scans++;
+
+		fd_high = top;
+		if (lim == max || top + 1 + FD_SLACK <= lim)
+			return (n);
+	}
+}
+
+/*
+ * Descriptors in use.  Where getdtablecount(2) is missing we keep
+ * count of the connections and scan only after the other descriptors
+ * changed, i.e. when sqlite opened or closed its files.
+ */
 int
-fcgi_client_cmp(struct client *a, struct client *b)
+fd_count(void)
+{
+#if defined(HAVE_GETDTABLECOUNT) && !HAVE_GETDTABLECOUNT
+	if (fd_base == -1)
+		fd_base = fd_scan() - fcgi_inflight;
+	return (fd_base + fcgi_inflight);
+#else
+	return (getdtablecount());
+#endif
+}
+
+void
+fd_recount(void)
 {
-	return ((int)a->clt_id - b->clt_id);
+	fd_base = -1;
 }
 
 int
@@ -759,19 +2065,24 @@ accept_reserve(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
 {
 	int ret;
 
-	if (getdtablecount() + reserve + *counter >= getdtablesize()) {
+	if (fd_count() + reserve + *counter >= getdtablesize()) {
 		errno = EMFILE;
 		return (-1);
 	}
 
 	if ((ret = accept4(sockfd, addr, addrlen, SOCK_NONBLOCK)) > -1) {
+		if (ret > fd_high)
+			fd_high = ret;
 		(*counter)++;
 		log_debug("%s: inflight incremented, now %d", __func__,
 		    *counter);
+	} else if (errno == EMFILE) {
+		/* we were wrong about the free descriptors */
+		stat_fd_drift++;
+		fd_recount();
 	}
 
 	return (ret);
 }
 
 SPLAY_GENERATE(fcgi_tree, fcgi, fcg_nodes, fcgi_cmp);
-SPLAY_GENERATE(client_tree, client, clt_nodes, fcgi_client_cmp);
@@ -12,7 +12,6 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 #include <syslog.h>
 #include <time.h>
 
@@ -22,6 +21,7 @@ __dead void	log_syslog_fatal(int, const char *, ...);
 __dead void	log_syslog_fatalx(int, const char *, ...);
 void		log_syslog_warn(const char *, ...);
 void		log_syslog_warnx(const char *, ...);
+void		log_syslog_notice(const char *, ...);
 void		log_syslog_info(const char *, ...);
 void		log_syslog_debug(const char *, ...);
 
@@ -30,6 +30,7 @@ const struct logger syslogger = {
 	.fatalx =	&log_syslog_fatalx,
 	.warn =		&log_syslog_warn,
 	.warnx =	&log_syslog_warnx,
+	.notice =	&log_syslog_notice,
 	.info =		&log_syslog_info,
 	.debug =	&log_syslog_debug,
 };
@@ -39,6 +40,7 @@ const struct logger dbglogger = {
 	.fatalx =	&errx,
 	.warn =		&warn,
 	.warnx =	&warnx,
+	.notice =	&warnx,
 	.info =		&warnx,
 	.debug =	&warnx,
 };
@@ -73,7 +75,7 @@ log_setverbose(int v)
 __dead void
 log_syslog_fatal(int eval, const char *fmt, ...)
 {
-	static char	 s[BUFSIZ];
+	char		 s[BUFSIZ];
 	va_list		 ap;
 	int		 r, save_errno;
 
@@ -86,7 +88,7 @@ log_syslog_fatal(int eval, const char *fmt, ...)
 	errno = save_errno;
 
 	if (r > 0 && (size_t)r <= sizeof(s))
-		syslog(LOG_DAEMON|LOG_CRIT, "%s: %s", s, strerror(errno));
+		syslog(LOG_DAEMON|LOG_CRIT, "%s: %m", s);
 
 	exit(eval);
 }
@@ -106,7 +108,7 @@ log_syslog_fatalx(int eval, const char *fmt, ...)
 void
 log_syslog_warn(const char *fmt, ...)
 {
-	static char	 s[BUFSIZ];
+	char		 s[BUFSIZ];
 	va_list		 ap;
 	int		 r, save_errno;
 
@@ -119,7 +121,7 @@ log_syslog_warn(const char *fmt, ...)
 	errno = save_errno;
 
 	if (r > 0 && (size_t)r < sizeof(s))
-		syslog(LOG_DAEMON|LOG_ERR, "%s: %s", s, strerror(errno));
+		syslog(LOG_DAEMON|LOG_ERR, "%s: %m", s);
 
 	errno = save_errno;
 }
@@ -137,6 +139,19 @@ log_syslog_warnx(const char *fmt, ...)
 	errno = save_errno;
 }
 
+void
+log_syslog_notice(const char *fmt, ...)
+{
+	va_list		 ap;
+	int		 save_errno;
+
+	save_errno = errno;
+	va_start(ap, fmt);
+	vsyslog(LOG_DAEMON|LOG_NOTICE, fmt, ap);
+	va_end(ap);
+	errno = save_errno;
+}
+
 void
 log_syslog_info(const char *fmt, ...)
 {
@@ -13,6 +13,7 @@ struct logger {
 	__dead void (*fatalx)(int, const char *, ...)	LOG_ATTR_PRINTF(2, 3);
 	void (*warn)(const char *, ...)			LOG_ATTR_PRINTF(1, 2);
 	void (*warnx)(const char *, ...)		LOG_ATTR_PRINTF(1, 2);
+	void (*notice)(const char *, ...)		LOG_ATTR_PRINTF(1, 2);
 	void (*info)(const char *, ...)			LOG_ATTR_PRINTF(1, 2);
 	void (*debug)(const char *, ...)		LOG_ATTR_PRINTF(1, 2);
 };
@@ -24,6 +25,7 @@ extern const struct logger *logger, syslogger, dbglogger;
 #define fatalx(...)	logger->fatalx(1, __VA_ARGS__)
 #define log_warn(...)	logger->warn(__VA_ARGS__)
 #define log_warnx(...)	logger->warnx(__VA_ARGS__)
+#define log_notice(...)	logger->notice(__VA_ARGS__)
 #define log_info(...)	logger->info(__VA_ARGS__)
 #define log_debug(...)	logger->debug(__VA_ARGS__)
 
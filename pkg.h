@@ -15,7 +15,42 @@
  */
 
 #define FD_RESERVE	5
+#define CTL_FD		4	/* socketpair with the parent process */
+#define IMAGE_FD	5	/* database image, with -M */
+#define MAX_REQUESTS	1024	/* concurrent requests per child */
+#define ACCEPT_BATCH	32	/* connections accepted per wakeup */
 #define GEMINI_MAXLEN	1025	/* including NUL */
+#define PARAM_NAMELEN	32	/* longest parameter name kept, with NUL */
+#define EXTRA_PARAMS	4	/* extra parameters captured with -e */
+
+#define CLT_HIWAT		(64 * 1024)
+#define CLT_LOWAT		(16 * 1024)
+
+/* recycled clients, keeping their buffers up to CLT_POOL_BUFSIZE */
+#define CLT_POOL		64
+#define CLT_POOL_BUFSIZE	(8 * 1024)
+#define CLT_ARENA		1024
+
+/* clt_buf starts small and grows up to the record size */
+#define RECORD_SIZE_MIN		1024
+#define RECORD_SIZE_MAX		65535
+
+#define STMT_CACHE		8
+
+#define SEARCH_LIMIT		50
+#define SEARCH_LIMIT_MAX	1000
+
+#define WORKERS			2
+#define WORKERS_MAX		16
+
+#define STATICCACHE_ENTRIES	16
+#define STATICCACHE_SIZE	(1024 * 1024)
+
+#define PAGECACHE_ENTRIES	4096
+#define PAGECACHE_SIZE		(16 * 1024 * 1024)
+
+#define SEARCHCACHE_ENTRIES	1024
+#define SEARCHCACHE_SIZE	(8 * 1024 * 1024)
 
 #ifdef DEBUG
 #define DPRINTF		log_debug
@@ -24,11 +59,76 @@
 #endif
 
 struct bufferevent;
+struct cache_entry;
+struct client;
+struct env;
 struct event;
+struct evbuffer;
 struct fcgi;
+struct image;
 struct sqlite3;
 struct sqlite3_stmt;
 
+typedef int (*route_t)(struct env *, struct client *);
+
+enum {
+	ACCEPT_SHARED,		/* every child accepts on the socket */
+	ACCEPT_EXCLUSIVE,	/* shared, loaded children step aside */
+	ACCEPT_DISPATCH,	/* the parent hands out the connections */
+};
+
+struct conf {
+	int			 cf_search_limit;
+	int			 cf_recsize;
+	int			 cf_workers;
+	int			 cf_accept;
+	int			 cf_image;
+	const char		*cf_params[EXTRA_PARAMS];
+	int			 cf_nparams;
+};
+
+/* messages on CTL_FD */
+enum {
+	CTL_LOAD,		/* child: connections in flight */
+	CTL_BUSY,		/* child: permille of time spent on the cpu */
+	CTL_RELOADED,		/* child: ms to re-open the db, -1 on error */
+	CTL_WARM,		/* child: ms to warm up the caches again */
+	CTL_CONN,		/* parent: a connection, passed along */
+	CTL_RETIRE,		/* parent: finish the requests and exit */
+	CTL_IMAGE,		/* parent: a new database image to re-open */
+	CTL_AVGLOAD,		/* parent: average connections in flight */
+};
+
+#define REPORT_INTERVAL		1	/* seconds between CTL_BUSY */
+#define DRAIN_TIMEOUT		10	/* seconds to finish the requests */
+
+struct ctl_msg {
+	int			 m_type;
+	int			 m_value;
+};
+
+struct cache {
+	const char		*c_name;
+	RB_HEAD(cache_tree, cache_entry) c_tree;
+	TAILQ_HEAD(cache_lru, cache_entry) c_lru;
+	size_t			 c_nentries;
+	size_t			 c_maxentries;
+	size_t			 c_size;
+	size_t			 c_maxsize;
+	unsigned int		 c_gen;		/* bumped by cache_clear */
+	unsigned long long	 c_hits;
+	unsigned long long	 c_misses;
+	unsigned long long	 c_evictions;
+};
+
+enum {
+	Q_SEARCH,
+	Q_FULLPKGPATH,
+	Q_CATS,
+	Q_BYCAT,
+	Q_MAX,
+};
+
 enum {
 	METHOD_UNKNOWN,
 	METHOD_GET,
@@ -44,27 +144,63 @@ struct client {
 	char			*clt_path_info;
 	char			*clt_query;
 	int			 clt_method;
+	int			 clt_output;	/* FCGI_STDOUT was sent */
+	char			*clt_params[EXTRA_PARAMS];	/* as in cf_params */
+
+	/* FCGI_PARAMS parser */
+	int			 clt_pdone;	/* stream ended, request handled */
+	int			 clt_pstate;
+	int			 clt_pparam;
+	uint8_t			 clt_plen[4];
+	size_t			 clt_plenpos;
+	size_t			 clt_pnlen;
+	size_t			 clt_pvlen;
+	size_t			 clt_ppos;
+	char			 clt_pname[PARAM_NAMELEN];
+	char			*clt_pval;
 #if template
 	struct template		*clt_tp;
 #endif
-	char			 clt_buf[1024];
+	char			*clt_buf;
+	size_t			 clt_bufsize;
 	size_t			 clt_buflen;
 
-	SPLAY_ENTRY(client)	 clt_nodes;
+	/* records to be saved in clt_cache once the reply is done */
+	uint8_t			*clt_rec;
+	size_t			 clt_recsize;
+	size_t			 clt_reclen;
+	struct cache		*clt_cache;
+	unsigned int		 clt_cachegen;
+	char			*clt_cachekey;
+
+	/* state of routes that may be suspended */
+	route_t			 clt_resume;
+	struct db		*clt_db;
+	struct sqlite3_stmt	*clt_stmt;
+	int			 clt_stmtq;
+	int			 clt_count;
+	struct job		*clt_job;
+	TAILQ_ENTRY(client)	 clt_entry;
+
+	/* storage for the parameters, must be last */
+	size_t			 clt_arenalen;
+	char			 clt_arena[CLT_ARENA];
 };
-SPLAY_HEAD(client_tree, client);
 
 struct fcgi {
 	uint32_t		 fcg_id;
 	int			 fcg_s;
-	struct client_tree	 fcg_clients;
+	struct client		**fcg_clients;	/* indexed by request id */
+	size_t			 fcg_maxclients;
+	size_t			 fcg_nclients;
+	TAILQ_HEAD(, client)	 fcg_suspended;
 	struct bufferevent	*fcg_bev;
-	int			 fcg_toread;
-	int			 fcg_want;
-	int			 fcg_padding;
-	int			 fcg_type;
-	int			 fcg_rec_id;
 	int			 fcg_keep_conn;
+
+	/* FCGI_PARAMS record being read */
+	int			 fcg_params_id;
+	size_t			 fcg_params_left;
+	size_t			 fcg_params_pad;
 	int			 fcg_done;
 
 	struct env		*fcg_env;
@@ -73,32 +209,101 @@ struct fcgi {
 };
 SPLAY_HEAD(fcgi_tree, fcgi);
 
+enum {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+};
+
+/* text columns copied for every row, followed by bm25 and rowid */
+#define JOB_COLS	3
+
+struct job {
+	TAILQ_ENTRY(job)	 j_entry;
+	int			 j_state;
+	struct client		*j_clt;		/* NULL once cancelled */
+	void			(*j_cb)(struct job *);
+
+	/* parameters */
+	char			*j_text;
+	int			 j_cursor;
+	int			 j_limit;
+
+	/* results */
+	char			*j_rows;	/* NUL-separated columns */
+	size_t			 j_len;
+	size_t			 j_cap;
+	size_t			 j_off;		/* where rendering is at */
+	int			 j_nrows;
+	int			 j_more;
+	int			 j_ok;
+	int			 j_reopened;	/* the worker opened the db */
+	double			 j_score;	/* of the last row */
+	int64_t			 j_rowid;
+};
+
+struct db {
+	struct sqlite3		*db_handle;
+	struct sqlite3_stmt	*db_stmts[Q_MAX][STMT_CACHE];
+	int			 db_nstmts[Q_MAX];
+	int			 db_refs;	/* statements in use */
+	struct image		*db_image;	/* or NULL */
+};
+
 struct env {
 	int			 env_sockfd;
 	struct event		 env_sockev;
 	struct event		 env_pausev;
+	struct event		 env_ctlev;
+	struct event		 env_reportev;
+	struct event		 env_drainev;
+	int			 env_draining;	/* 2 once the requests are ended */
+	time_t			 env_drain_by;
 	struct fcgi_tree	 env_fcgi_socks;
 
-	struct sqlite3		*env_db;
-	struct sqlite3_stmt	*env_qsearch;
-	struct sqlite3_stmt	*env_qfullpkgpath;
-	struct sqlite3_stmt	*env_qcats;
-	struct sqlite3_stmt	*env_qbycat;
+	struct db		*env_db;
+
+	struct cache		 env_static;
+	struct cache		 env_pagecache;
+	struct cache		 env_searchcache;
 };
 
+/* pkg_fcgi.c */
+extern struct conf	 conf;
+
+/* cache.c */
+void	cache_init(struct cache *, const char *, size_t, size_t);
+int	cache_get(struct cache *, const char *, uint8_t **, size_t *);
+void	cache_put(struct cache *, const char *, const uint8_t *, size_t);
+void	cache_clear(struct cache *);
+void	cache_stats(struct cache *);
+
 /* fcgi.c */
 int	fcgi_end_request(struct client *, int);
 int	fcgi_abort_request(struct client *);
 void	fcgi_accept(int, short, void *);
+void	fcgi_recv(int, short, void *);
+int	fcgi_idle(struct env *);
+int	fcgi_end_all(struct env *);
+void	fcgi_drain(struct env *);
+void	ctl_send(int, int);
 void	fcgi_read(struct bufferevent *, void *);
 void	fcgi_write(struct bufferevent *, void *);
 void	fcgi_error(struct bufferevent *, short, void *);
 void	fcgi_free(struct fcgi *);
+void	fcgi_stats(void);
+char	*clt_stralloc(struct client *, size_t);
+char	*clt_strndup(struct client *, const char *, size_t);
+char	*clt_strdup(struct client *, const char *);
+void	 clt_strfree(struct client *, char *);
 int	clt_putc(struct client *, char);
 int	clt_puts(struct client *, const char *);
 int	clt_write_bufferevent(struct client *, struct bufferevent *);
 int	clt_flush(struct client *);
 int	clt_write(struct client *, const uint8_t *, size_t);
+int	clt_write_records(struct client *, uint8_t *, size_t);
+int	clt_congested(struct client *);
+void	clt_suspend(struct client *, route_t);
 int	clt_printf(struct client *, const char *, ...)
 	    __attribute__((__format__(printf, 2, 3)))
 	    __attribute__((__nonnull__(2)));
@@ -107,17 +312,29 @@ int	clt_tp_puts(struct template *, const char *);
 int	clt_tp_putc(struct template *, int);
 #endif
 int	fcgi_cmp(struct fcgi *, struct fcgi *);
-int	fcgi_client_cmp(struct client *, struct client *);
+int	fd_count(void);
+void	fd_recount(void);
 
 /* server.c */
 int	server_main(const char *);
 int	server_handle(struct env *, struct client *);
 void	server_client_free(struct client *);
+void	server_drain(struct env *);
+void	server_image(struct env *, int);
+int	server_connect(struct sqlite3 **, struct image **);
+void	server_disconnect(struct sqlite3 *, struct image *);
+
+/* worker.c */
+void		 worker_init(const char *, const char *, int);
+void		 worker_reload(void);
+struct job	*worker_job_new(struct client *, const char *);
+void		 worker_job_free(struct job *);
+void		 worker_submit(struct job *, void (*)(struct job *));
+void		 worker_cancel(struct job *);
 
 #if template
 /* ui.tmpl */
 int	tp_home(struct template *);
 #endif
 
-SPLAY_PROTOTYPE(client_tree, client, clt_nodes, fcgi_client_cmp);
 SPLAY_PROTOTYPE(fcgi_tree, fcgi, fcg_nodes, fcgi_cmp);
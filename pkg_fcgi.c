@@ -14,10 +14,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/mman.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/tree.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 
@@ -25,6 +28,7 @@
 #include <event.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <libgen.h>
 #include <limits.h>
 #include <pwd.h>
 #include <signal.h>
@@ -32,11 +36,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "log.h"
 #include "pkg.h"
 
+#if HAVE_INOTIFY
+#include <sys/inotify.h>
+#elif !defined(HAVE_KQUEUE) || HAVE_KQUEUE
+#include <sys/event.h>
+#define WATCH_KQUEUE
+#endif
+
 #ifndef PKG_FCGI_DB
 #define PKG_FCGI_DB "/pkg_fcgi/pkgs.sqlite3"
 #endif
@@ -51,27 +63,923 @@
 
 #define MAX_CHILDREN	32
 
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+
+#ifndef nitems
+#define nitems(_a) (sizeof((_a)) / sizeof((_a)[0]))
+#endif
+
+struct conf			 conf = {
+	.cf_search_limit =	SEARCH_LIMIT,
+	.cf_recsize =		RECORD_SIZE_MAX,
+	.cf_workers =		WORKERS,
+};
+
+/* respawn delay for children that crash soon after starting */
+#define RESPAWN_FAST	10	/* seconds */
+#define RESPAWN_MAX	60	/* seconds */
+
+/* resizing of the pool between -j and -m children */
+#define POOL_INTERVAL	5	/* seconds between checks */
+#define POOL_GROW	700	/* permille busy to add a child */
+#define POOL_SHRINK	200	/* permille busy to retire one... */
+#define POOL_IDLE	6	/* ...for this many checks in a row */
+#define POOL_GROW_LOAD	32	/* connections in flight to add a child */
+#define POOL_SHRINK_LOAD 4	/* ...and to retire one */
+
+/* rolling reload of the database, a child at a time */
+#define ROLL_SETTLE	1	/* seconds to wait after a change */
+#define ROLL_TIMEOUT	30	/* seconds for a child to warm up */
+
+struct proc {
+	pid_t			 p_pid;
+	int			 p_fd;		/* CTL_FD in the child */
+	int			 p_load;	/* connections in flight */
+	struct event		 p_ev;
+
+	int			 p_busy;	/* CTL_BUSY since last check */
+	int			 p_nbusy;
+	int			 p_loads;	/* p_load at every CTL_BUSY */
+	int			 p_retiring;
+
+	time_t			 p_started;
+	int			 p_backoff;	/* seconds */
+	int			 p_restarts;
+	struct event		 p_timer;	/* pending respawn */
+};
+
 static const char		*argv0;
-static pid_t			 pids[MAX_CHILDREN];
-static int			 children = 3;
+static const char		*dbname;
+static struct proc		 procs[MAX_CHILDREN];
+static int			 children = 3;	/* at least */
+static int			 maxchildren;	/* at most */
+static int			 backlog = SOMAXCONN;
+static int			 nprocs;	/* still running */
+static int			 shutting_down;
+static struct event		 pool_ev;
+static int			 pool_idle;
+
+static int			 watch_fd = -1;
+static int			 watch_dirfd = -1;	/* kqueue only */
+static struct event		 watch_ev;
+static struct stat		 watch_st;
+static struct event		 roll_ev;
+static int			 roll_next = -1;	/* being reloaded */
+static int			 roll_again;
+static struct timespec		 roll_start;
+
+static struct event_base	*evbase;
+static int			 listenfd = -1;
+static int			 image_fd = -1;		/* with -M */
+static int			 image_next = -1;	/* being rolled out */
+static struct event		 accept_ev;
+static struct event		 accept_pause;
+
+static const char *accept_modes[] = {
+	[ACCEPT_SHARED] =	"shared",
+	[ACCEPT_EXCLUSIVE] =	"exclusive",
+	[ACCEPT_DISPATCH] =	"dispatch",
+};
+
+static void	proc_read(int, short, void *);
+static void	share_load(void);
+static int	proc_send(struct proc *, int, int);
+
+/*
+ * Move the listening socket, if any, to fd 3 and the control socket
+ * to CTL_FD, where the child expects them.
+ */
+static void
+child_fds(int fd, int ctl)
+{
+	/* don't clobber it when moving the socket to fd 3 */
+	if (ctl == 3 && (ctl = dup(ctl)) == -1)
+		fatal("cannot setup imsg fd");
+
+	/* in dispatch mode the connections come from the control fd */
+	if (fd != -1 && fd != 3) {
+		if (dup2(fd, 3) == -1)
+			fatal("cannot setup imsg fd");
+	} else if (fd == 3 && fcntl(fd, F_SETFD, 0) == -1)
+		fatal("cannot setup imsg fd");
+
+	if (ctl != CTL_FD) {
+		if (dup2(ctl, CTL_FD) == -1)
+			fatal("cannot setup control fd");
+	} else if (fcntl(ctl, F_SETFD, 0) == -1)
+		fatal("cannot setup control fd");
+}
+
+/*
+ * Move the database image to IMAGE_FD.  It was created above it, so
+ * it can't have been clobbered by child_fds.
+ */
+static void
+child_image(int img)
+{
+	if (dup2(img, IMAGE_FD) == -1)
+		fatal("cannot setup image fd");
+	close(img);
+}
+
+/*
+ * Copy the database in a sealed memfd that the children can map.
+ */
+static int
+image_load(const char *path)
+{
+#if HAVE_MEMFD
+	char		 buf[65536];
+	ssize_t		 r, w, off;
+	int		 fd, mfd, t;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		log_warn("open %s", path);
+		return (-1);
+	}
+
+	if ((mfd = memfd_create("pkg_fcgi", MFD_CLOEXEC |
+	    MFD_ALLOW_SEALING)) == -1) {
+		log_warn("memfd_create");
+		close(fd);
+		return (-1);
+	}
+	if (mfd <= IMAGE_FD) {
+		t = fcntl(mfd, F_DUPFD_CLOEXEC, IMAGE_FD + 1);
+		close(mfd);
+		if ((mfd = t) == -1) {
+			log_warn("fcntl");
+			close(fd);
+			return (-1);
+		}
+	}
+
+	for (;;) {
+		if ((r = read(fd, buf, sizeof(buf))) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_warn("read %s", path);
+			goto err;
+		}
+		if (r == 0)
+			break;
+		for (off = 0; off < r; off += w) {
+			if ((w = write(mfd, buf + off, r - off)) == -1) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				log_warn("%s: write", __func__);
+				goto err;
+			}
+		}
+	}
+
+	if (fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+	    F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+		log_warn("%s: F_ADD_SEALS", __func__);
+		goto err;
+	}
+
+	close(fd);
+	return (mfd);
+
+ err:
+	close(fd);
+	close(mfd);
+	return (-1);
+#else
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+/*
+ * Start a child in slot p.  We're already chrooted and unprivileged,
+ * so it can't be re-executed: fork and run the server right away,
+ * after dropping everything that belongs to the parent.
+ */
+static int
+proc_spawn(struct proc *p)
+{
+	int		 i, img, sp[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+	    SOCK_CLOEXEC, 0, sp) == -1) {
+		log_warn("%s: socketpair", __func__);
+		return (-1);
+	}
+
+	switch (p->p_pid = fork()) {
+	case -1:
+		log_warn("%s: fork", __func__);
+		close(sp[0]);
+		close(sp[1]);
+		return (-1);
+	case 0:
+		break;
+	default:
+		close(sp[1]);
+		p->p_fd = sp[0];
+		p->p_load = 0;
+		p->p_busy = p->p_nbusy = p->p_loads = 0;
+		p->p_started = time(NULL);
+		nprocs++;
+		event_set(&p->p_ev, p->p_fd, EV_READ | EV_PERSIST,
+		    proc_read, p);
+		event_add(&p->p_ev, NULL);
+		return (0);
+	}
+
+	/* the event base is shared with the parent until re-init */
+	if (event_reinit(evbase) == -1)
+		fatalx("event_reinit");
+	event_base_free(evbase);
+
+	for (i = 0; i < maxchildren; ++i)
+		if (procs[i].p_fd != -1)
+			close(procs[i].p_fd);
+	if (watch_fd != -1)
+		close(watch_fd);
+	if (watch_dirfd != -1)
+		close(watch_dirfd);
+	close(sp[0]);
+
+	/* the roll won't come back to the slots it's past */
+	img = image_fd;
+	if (image_next != -1 && p - procs < roll_next) {
+		img = image_next;
+		close(image_fd);
+	} else if (image_next != -1)
+		close(image_next);
+
+	child_fds(conf.cf_accept == ACCEPT_DISPATCH ? -1 : listenfd, sp[1]);
+	if (listenfd != CTL_FD &&
+	    (listenfd != 3 || conf.cf_accept == ACCEPT_DISPATCH))
+		close(listenfd);
+	if (sp[1] != CTL_FD && sp[1] != 3)
+		close(sp[1]);
+	if (img != -1)
+		child_image(img);
+
+	exit(server_main(dbname));
+}
+
+/*
+ * Replace a dead child.
+ */
+static void
+proc_respawn(int fd, short ev, void *arg)
+{
+	struct proc	*p = arg;
+
+	if (proc_spawn(p) == -1)
+		return;
+
+	p->p_restarts++;
+	log_info("restarted child %d (pid %lld), %d restarts",
+	    (int)(p - procs), (long long)p->p_pid, p->p_restarts);
+}
+
+static void
+proc_retire(struct proc *p)
+{
+	struct ctl_msg	 msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.m_type = CTL_RETIRE;
+	if (send(p->p_fd, &msg, sizeof(msg), 0) == -1) {
+		log_warn("%s: send", __func__);
+		return;
+	}
+
+	p->p_retiring = 1;
+	log_info("retiring child %d (pid %lld)", (int)(p - procs),
+	    (long long)p->p_pid);
+}
+
+/*
+ * Add a child when the ones we have are busy, or when connections
+ * pile up because they're waiting for the disk; retire one after
+ * they have been mostly idle for a while.
+ */
+static void
+pool_adjust(int fd, short ev, void *arg)
+{
+	struct proc	*p, *idlest = NULL, *slot = NULL;
+	struct timeval	 tv = { POOL_INTERVAL, 0 };
+	int		 i, n = 0, busy = 0, load = 0;
+
+	evtimer_add(&pool_ev, &tv);
+
+	for (i = 0; i < maxchildren; ++i) {
+		p = &procs[i];
+		if (p->p_pid == -1) {
+			if (slot == NULL && !p->p_retiring &&
+			    !evtimer_pending(&p->p_timer, NULL))
+				slot = p;
+			continue;
+		}
+		if (p->p_retiring)
+			continue;
+
+		n++;
+		if (p->p_nbusy > 0) {
+			busy += p->p_busy / p->p_nbusy;
+			load += p->p_loads / p->p_nbusy;
+		}
+		p->p_busy = p->p_nbusy = p->p_loads = 0;
+
+		if (idlest == NULL || p->p_load <= idlest->p_load)
+			idlest = p;
+	}
+
+	if (n == 0)
+		return;
+	busy /= n;
+	load /= n;
+	log_debug("%s: %d children, %d%% busy, %d connections each",
+	    __func__, n, busy / 10, load);
+
+	if ((busy >= POOL_GROW || load >= POOL_GROW_LOAD) && slot != NULL) {
+		pool_idle = 0;
+		if (proc_spawn(slot) == 0)
+			log_info("%d%% busy, %d connections each, started"
+			    " child %d (pid %lld)", busy / 10, load,
+			    (int)(slot - procs), (long long)slot->p_pid);
+		return;
+	}
+
+	if (busy >= POOL_SHRINK || load >= POOL_SHRINK_LOAD ||
+	    n <= children) {
+		pool_idle = 0;
+		return;
+	}
+
+	if (++pool_idle >= POOL_IDLE) {
+		pool_idle = 0;
+		proc_retire(idlest);
+	}
+}
 
-static volatile sig_atomic_t	 got_sigchld;
+static void	roll_schedule(void);
 
+/*
+ * Send SIGHUP to the next child from roll_next on, and wait until its
+ * caches are warm again before moving on, so that they don't all
+ * start cold at the same time.
+ */
 static void
-handle_sigchld(int sig)
+roll_advance(void)
 {
-	int	i, saved_errno;
+	struct timeval	 tv = { ROLL_TIMEOUT, 0 };
+	struct timespec	 now;
+	struct proc	*p;
 
-	if (got_sigchld)
+	for (; roll_next < maxchildren; ++roll_next) {
+		p = &procs[roll_next];
+		if (p->p_pid == -1 || p->p_retiring)
+			continue;
+		if (image_next != -1) {
+			if (proc_send(p, CTL_IMAGE, image_next) == -1) {
+				log_warn("%s: sendmsg", __func__);
+				continue;
+			}
+		} else if (kill(p->p_pid, SIGHUP) == -1) {
+			log_warn("%s: kill %lld", __func__,
+			    (long long)p->p_pid);
+			continue;
+		}
+		evtimer_add(&roll_ev, &tv);
 		return;
+	}
 
-	got_sigchld = 1;
-	saved_errno = errno;
+	/* the children that will be started get the new image too */
+	if (image_next != -1) {
+		close(image_fd);
+		image_fd = image_next;
+		image_next = -1;
+	}
 
-	for (i = 0; i < children; ++i)
-		(void) kill(pids[i], SIGTERM);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	log_info("children reloaded in %lld ms",
+	    (now.tv_sec - roll_start.tv_sec) * 1000LL +
+	    (now.tv_nsec - roll_start.tv_nsec) / 1000000);
+	roll_next = -1;
 
-	errno = saved_errno;
+	if (roll_again) {
+		roll_again = 0;
+		roll_schedule();
+	}
+}
+
+static void
+roll_timeout(int fd, short ev, void *arg)
+{
+	if (roll_next == -1) {
+		log_info("reloading the children");
+		clock_gettime(CLOCK_MONOTONIC, &roll_start);
+		if (conf.cf_image &&
+		    (image_next = image_load(dbname)) == -1) {
+			log_warnx("can't load %s, keeping the old one",
+			    dbname);
+			return;
+		}
+		roll_next = 0;
+	} else {
+		log_warnx("child %d not warmed up after %d seconds",
+		    roll_next, ROLL_TIMEOUT);
+		roll_next++;
+	}
+	roll_advance();
+}
+
+/*
+ * Start a reload once things settle down, or after the current one.
+ */
+static void
+roll_schedule(void)
+{
+	struct timeval	 tv = { ROLL_SETTLE, 0 };
+
+	if (shutting_down)
+		return;
+	if (roll_next != -1) {
+		roll_again = 1;
+		return;
+	}
+	evtimer_add(&roll_ev, &tv);
+}
+
+/*
+ * Move on from child p, if it's the one being reloaded.
+ */
+static void
+roll_skip(struct proc *p)
+{
+	if (roll_next == -1 || p != &procs[roll_next])
+		return;
+	evtimer_del(&roll_ev);
+	roll_next++;
+	roll_advance();
+}
+
+/*
+ * If the new database is bad, the other children keep the one they
+ * have.
+ */
+static void
+roll_reloaded(struct proc *p, int ms)
+{
+	if (roll_next == -1 || p != &procs[roll_next])
+		return;
+
+	if (ms == -1) {
+		log_warnx("child %d can't use the new db, stopping the reload",
+		    roll_next);
+		evtimer_del(&roll_ev);
+		roll_next = -1;
+		roll_again = 0;
+		if (image_next != -1) {
+			close(image_next);
+			image_next = -1;
+		}
+		return;
+	}
+	log_debug("child %d re-opened the db in %d ms", roll_next, ms);
+}
+
+static int
+watch_changed(void)
+{
+	struct stat	 sb;
+
+	/* in the middle of being replaced */
+	if (stat(dbname, &sb) == -1)
+		return (0);
+
+	if (sb.st_dev == watch_st.st_dev && sb.st_ino == watch_st.st_ino &&
+	    sb.st_size == watch_st.st_size &&
+	    sb.st_mtime == watch_st.st_mtime)
+		return (0);
+	watch_st = sb;
+	return (1);
+}
+
+static void
+watch_read(int fd, short ev, void *arg)
+{
+#if HAVE_INOTIFY
+	char		 buf[4096];
+	ssize_t		 r;
+
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		continue;
+	if (r == -1 && errno != EAGAIN && errno != EINTR)
+		log_warn("%s: read", __func__);
+#elif defined(WATCH_KQUEUE)
+	struct kevent	 kev[8];
+	struct timespec	 ts = { 0, 0 };
+
+	if (kevent(fd, NULL, 0, kev, nitems(kev), &ts) == -1)
+		log_warn("%s: kevent", __func__);
+#endif
+
+	if (watch_changed()) {
+		log_info("%s was replaced", dbname);
+		roll_schedule();
+	}
+}
+
+/*
+ * Watch the directory of the database: the snapshot is replaced by
+ * renaming the new one over it.
+ */
+static void
+watch_init(void)
+{
+	char		*t, *dir;
+#ifdef WATCH_KQUEUE
+	struct kevent	 kev;
+#endif
+
+	if ((t = strdup(dbname)) == NULL)
+		fatal("strdup");
+	dir = dirname(t);
+
+#if HAVE_INOTIFY
+	if ((watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		log_warn("inotify_init1");
+		goto done;
+	}
+	if (inotify_add_watch(watch_fd, dir, IN_MOVED_TO | IN_CLOSE_WRITE)
+	    == -1) {
+		log_warn("inotify_add_watch %s", dir);
+		close(watch_fd);
+		watch_fd = -1;
+		goto done;
+	}
+#elif defined(WATCH_KQUEUE)
+	if ((watch_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+	    == -1) {
+		log_warn("open %s", dir);
+		goto done;
+	}
+	if ((watch_fd = kqueue()) == -1) {
+		log_warn("kqueue");
+		goto done;
+	}
+	EV_SET(&kev, watch_dirfd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+	    NOTE_WRITE, 0, NULL);
+	if (kevent(watch_fd, &kev, 1, NULL, 0, NULL) == -1) {
+		log_warn("kevent %s", dir);
+		close(watch_fd);
+		watch_fd = -1;
+		goto done;
+	}
+#else
+	log_info("not watching %s for changes", dbname);
+	goto done;
+#endif
+
+	if (stat(dbname, &watch_st) == -1)
+		log_warn("stat %s", dbname);
+
+	event_set(&watch_ev, watch_fd, EV_READ | EV_PERSIST, watch_read,
+	    NULL);
+	event_add(&watch_ev, NULL);
+
+ done:
+	free(t);
+}
+
+static void
+handle_sigchld(int sig, short ev, void *arg)
+{
+	struct proc	*p;
+	struct timeval	 tv;
+	const char	*cause;
+	pid_t		 pid;
+	int		 i, status;
+
+	for (;;) {
+		pid = waitpid(WAIT_ANY, &status, WNOHANG);
+		if (pid == 0)
+			return;
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ECHILD)
+				fatal("waitpid failed");
+			return;
+		}
+
+		if (WIFSIGNALED(status))
+			cause = "was terminated";
+		else if (WIFEXITED(status)) {
+			if (WEXITSTATUS(status) != 0)
+				cause = "exited abnormally";
+			else
+				cause = "exited successfully";
+		} else
+			cause = "died";
+
+		log_warnx("child process %lld %s", (long long)pid, cause);
+
+		for (i = 0; i < maxchildren; ++i)
+			if (procs[i].p_pid == pid)
+				break;
+		if (i == maxchildren)
+			continue;
+
+		p = &procs[i];
+		p->p_pid = -1;
+		event_del(&p->p_ev);
+		close(p->p_fd);
+		p->p_fd = -1;
+
+		/* don't wait for it to re-open the db */
+		roll_skip(p);
+
+		if (--nprocs == 0 && shutting_down)
+			event_loopexit(NULL);
+		if (shutting_down)
+			continue;
+
+		if (p->p_retiring) {
+			p->p_retiring = 0;
+			p->p_backoff = 0;
+			continue;
+		}
+
+		/* back off if it keeps crashing right after starting */
+		if (time(NULL) - p->p_started < RESPAWN_FAST)
+			p->p_backoff = p->p_backoff == 0 ? 1 :
+			    MIN(p->p_backoff * 2, RESPAWN_MAX);
+		else
+			p->p_backoff = 0;
+
+		if (p->p_backoff != 0)
+			log_warnx("restarting child %d in %d seconds", i,
+			    p->p_backoff);
+
+		timerclear(&tv);
+		tv.tv_sec = p->p_backoff;
+		evtimer_set(&p->p_timer, proc_respawn, p);
+		evtimer_add(&p->p_timer, &tv);
+	}
+}
+
+static void
+handle_sigterm(int sig, short ev, void *arg)
+{
+	int		 i;
+
+	if (shutting_down)
+		return;
+	shutting_down = 1;
+	log_info("stopping the children");
+
+	if (maxchildren > children)
+		evtimer_del(&pool_ev);
+	evtimer_del(&roll_ev);
+	if (conf.cf_accept == ACCEPT_DISPATCH) {
+		event_del(&accept_ev);
+		evtimer_del(&accept_pause);
+	}
+
+	/* they finish the requests in progress before exiting */
+	for (i = 0; i < maxchildren; ++i) {
+		if (procs[i].p_pid != -1)
+			(void) kill(procs[i].p_pid, SIGTERM);
+		else if (evtimer_pending(&procs[i].p_timer, NULL))
+			evtimer_del(&procs[i].p_timer);
+	}
+
+	if (nprocs == 0)
+		event_loopexit(NULL);
+}
+
+static void
+handle_signal(int sig, short ev, void *arg)
+{
+	int		 i;
+
+	if (sig == SIGUSR1) {
+		log_notice("children: %d running, between %d and %d",
+		    nprocs, children, maxchildren);
+		for (i = 0; i < maxchildren; ++i)
+			if (procs[i].p_pid != -1 || procs[i].p_restarts > 0)
+				log_notice("child %d: pid %lld, %d connections,"
+				    " %d restarts%s", i,
+				    (long long)procs[i].p_pid,
+				    procs[i].p_load, procs[i].p_restarts,
+				    procs[i].p_retiring ? ", retiring" : "");
+	}
+
+	if (sig == SIGHUP) {
+		roll_schedule();
+		return;
+	}
+
+	/* stats are per-child business */
+	for (i = 0; i < maxchildren; ++i)
+		if (procs[i].p_pid != -1)
+			(void) kill(procs[i].p_pid, sig);
+}
+
+static void
+proc_read(int fd, short ev, void *arg)
+{
+	struct proc	*p = arg;
+	struct ctl_msg	 msg;
+	ssize_t		 n;
+
+	for (;;) {
+		if ((n = recv(fd, &msg, sizeof(msg), 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				log_warn("%s: recv", __func__);
+			return;
+		}
+
+		/* the child is exiting, SIGCHLD will follow */
+		if (n == 0) {
+			event_del(&p->p_ev);
+			return;
+		}
+
+		if (n != sizeof(msg)) {
+			log_warnx("%s: unexpected message from child %lld",
+			    __func__, (long long)p->p_pid);
+			continue;
+		}
+
+		switch (msg.m_type) {
+		case CTL_LOAD:
+			p->p_load = msg.m_value;
+			if (conf.cf_accept == ACCEPT_EXCLUSIVE)
+				share_load();
+			break;
+		case CTL_BUSY:
+			p->p_busy += msg.m_value;
+			p->p_loads += p->p_load;
+			p->p_nbusy++;
+			break;
+		case CTL_RELOADED:
+			roll_reloaded(p, msg.m_value);
+			break;
+		case CTL_WARM:
+			roll_skip(p);
+			break;
+		default:
+			log_warnx("%s: unexpected message from child %lld",
+			    __func__, (long long)p->p_pid);
+			break;
+		}
+	}
+}
+
+/*
+ * In exclusive mode the children above the average load stop
+ * accepting; let them know when it changes.
+ */
+static void
+share_load(void)
+{
+	struct ctl_msg	 msg;
+	struct proc	*p;
+	static int	 last = -1;
+	int		 i, n = 0, sum = 0;
+
+	for (i = 0; i < maxchildren; ++i) {
+		p = &procs[i];
+		if (p->p_pid == -1 || p->p_fd == -1 || p->p_retiring ||
+		    p->p_load == INT_MAX)
+			continue;
+		sum += p->p_load;
+		n++;
+	}
+	if (n == 0 || sum / n == last)
+		return;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.m_type = CTL_AVGLOAD;
+	msg.m_value = last = sum / n;
+
+	for (i = 0; i < maxchildren; ++i) {
+		p = &procs[i];
+		if (p->p_pid == -1 || p->p_fd == -1 || p->p_retiring)
+			continue;
+		if (send(p->p_fd, &msg, sizeof(msg), 0) == -1) {
+			log_debug("%s: child %lld: %s", __func__,
+			    (long long)p->p_pid, strerror(errno));
+			last = -1;	/* try again next time */
+		}
+	}
+}
+
+static int
+proc_send(struct proc *p, int type, int s)
+{
+	struct ctl_msg	 msg;
+	struct msghdr	 mh;
+	struct cmsghdr	*cmsg;
+	struct iovec	 iov;
+	union {
+		struct cmsghdr	 hdr;
+		char		 buf[CMSG_SPACE(sizeof(int))];
+	}		 cmsgbuf;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.m_type = type;
+
+	memset(&mh, 0, sizeof(mh));
+	memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = &cmsgbuf.buf;
+	mh.msg_controllen = sizeof(cmsgbuf.buf);
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cmsg), &s, sizeof(s));
+
+	while (sendmsg(p->p_fd, &mh, 0) == -1) {
+		if (errno != EINTR)
+			return (-1);
+	}
+
+	/* count it now, the child reports back once it's set up */
+	if (type == CTL_CONN)
+		p->p_load++;
+	return (0);
+}
+
+/*
+ * Accept the pending connections and hand each one to the least
+ * loaded child.
+ */
+static void
+dispatch_accept(int fd, short ev, void *arg)
+{
+	struct proc	*p = NULL;
+	int		 i, n, s, tries;
+	static int	 next;
+
+	event_add(&accept_ev, NULL);
+	if (ev & EV_TIMEOUT)
+		return;
+
+	for (n = 0; n < ACCEPT_BATCH; ++n) {
+		if ((s = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) == -1) {
+			if (errno == ENFILE || errno == EMFILE) {
+				struct timeval evtpause = { 1, 0 };
+
+				event_del(&accept_ev);
+				evtimer_add(&accept_pause, &evtpause);
+				log_warn("%s: accept", __func__);
+			} else if (errno != EAGAIN && errno != EINTR &&
+			    errno != ECONNABORTED)
+				log_warn("%s: accept", __func__);
+			return;
+		}
+
+		/*
+		 * Start the scan from a different child every time
+		 * so that ties are spread around.
+		 */
+		next = (next + 1) % maxchildren;
+		for (tries = 0; tries < maxchildren; ++tries) {
+			p = NULL;
+			for (i = 0; i < maxchildren; ++i) {
+				struct proc *q;
+
+				q = &procs[(next + i) % maxchildren];
+				if (q->p_pid == -1 || q->p_fd == -1 ||
+				    q->p_retiring || q->p_load == INT_MAX)
+					continue;
+				if (p == NULL || q->p_load < p->p_load)
+					p = q;
+			}
+			if (p == NULL || proc_send(p, CTL_CONN, s) == 0)
+				break;
+
+			/* its queue is full, skip it this round */
+			log_debug("%s: child %lld: %s", __func__,
+			    (long long)p->p_pid, strerror(errno));
+			p->p_load = INT_MAX;
+		}
+		if (p == NULL || tries == maxchildren)
+			log_warnx("%s: no child to take the connection",
+			    __func__);
+		close(s);
+	}
 }
 
 static int
@@ -80,7 +988,7 @@ bind_socket(const char *path, struct passwd *pw)
 	struct sockaddr_un	 sun;
 	int			 fd, old_umask;
 
-	if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0)) == -1) {
+	if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1) {
 		log_warn("%s: socket", __func__);
 		return (-1);
 	}
@@ -124,7 +1032,7 @@ bind_socket(const char *path, struct passwd *pw)
 		return (-1);
 	}
 
-	if (listen(fd, 5) == -1) {
+	if (listen(fd, backlog) == -1) {
 		log_warn("%s: listen", __func__);
 		close(fd);
 		(void) unlink(path);
@@ -136,10 +1044,13 @@ bind_socket(const char *path, struct passwd *pw)
 
 static pid_t
 start_child(const char *root, const char *user, const char *db,
-    int daemonize, int verbose, int fd)
+    int daemonize, int verbose, int fd, int ctl)
 {
-	char	*argv[10];
-	int	 argc = 0;
+	char	*argv[32];
+	char	 limit[16];
+	char	 recsize[16];
+	char	 workers[16];
+	int	 argc = 0, i;
 	pid_t	 pid;
 
 	switch (pid = fork()) {
@@ -148,24 +1059,38 @@ start_child(const char *root, const char *user, const char *db,
 	case 0:
 		break;
 	default:
-		close(fd);
+		if (fd != -1)
+			close(fd);
+		close(ctl);
 		return (pid);
 	}
 
-	if (fd != 3) {
-		if (dup2(fd, 3) == -1)
-			fatal("cannot setup imsg fd");
-	} else if (fcntl(fd, F_SETFD, 0) == -1)
-		fatal("cannot setup imsg fd");
+	child_fds(fd, ctl);
+	if (image_fd != -1)
+		child_image(image_fd);
 
 	argv[argc++] = (char *)argv0;
 	argv[argc++] = (char *)"-S";
+	argv[argc++] = (char *)"-a";
+	argv[argc++] = (char *)accept_modes[conf.cf_accept];
 	argv[argc++] = (char *)"-p"; argv[argc++] = (char *)root;
 	argv[argc++] = (char *)"-u"; argv[argc++] = (char *)user;
+	(void)snprintf(limit, sizeof(limit), "%d", conf.cf_search_limit);
+	argv[argc++] = (char *)"-n"; argv[argc++] = limit;
+	(void)snprintf(recsize, sizeof(recsize), "%d", conf.cf_recsize);
+	argv[argc++] = (char *)"-r"; argv[argc++] = recsize;
+	(void)snprintf(workers, sizeof(workers), "%d", conf.cf_workers);
+	argv[argc++] = (char *)"-w"; argv[argc++] = workers;
 	if (!daemonize)
 		argv[argc++] = (char *)"-d";
 	if (verbose)
 		argv[argc++] = (char *)"-v";
+	if (conf.cf_image)
+		argv[argc++] = (char *)"-M";
+	for (i = 0; i < conf.cf_nparams; ++i) {
+		argv[argc++] = (char *)"-e";
+		argv[argc++] = (char *)conf.cf_params[i];
+	}
 	argv[argc++] = (char *)db;
 	argv[argc++] = NULL;
 
@@ -177,7 +1102,9 @@ static void __dead
 usage(void)
 {
 	fprintf(stderr,
-	    "usage: %s [-dv] [-j n] [-p path] [-s socket] [-u user] [db]\n",
+	    "usage: %s [-dMv] [-a mode] [-b backlog] [-e variable] [-j n]"
+	    " [-m max] [-n results] [-p path] [-r size] [-s socket]"
+	    " [-u user] [-w threads] [db]\n",
 	    getprogname());
 	exit(1);
 }
@@ -187,9 +1114,8 @@ main(int argc, char **argv)
 {
 	struct stat	 sb;
 	struct passwd	*pw;
-	pid_t		 pid;
+	struct event	 sigchld, sighup, sigusr1, sigint, sigterm;
 	char		 path[PATH_MAX];
-	const char	*cause;
 	const char	*root = NULL;
 	const char	*sock = PKG_FCGI_SOCK;
 	const char	*user = PKG_FCGI_USER;
@@ -197,7 +1123,7 @@ main(int argc, char **argv)
 	const char	*errstr;
 	int		 ch, i, daemonize = 1, verbosity = 0;
 	int		 server = 0, fd = -1;
-	int		 status;
+	int		 sp[2];
 
 	/*
 	 * Ensure we have fds 0-2 open so that we have no issue with
@@ -220,20 +1146,64 @@ main(int argc, char **argv)
 	if ((argv0 = argv[0]) == NULL)
 		fatalx("argv[0] is NULL");
 
-	while ((ch = getopt(argc, argv, "dj:p:Ss:u:v")) != -1) {
+	while ((ch = getopt(argc, argv, "a:b:de:j:Mm:n:p:r:Ss:u:vw:")) != -1) {
 		switch (ch) {
+		case 'a':
+			for (i = 0; i < (int)nitems(accept_modes); ++i)
+				if (!strcmp(optarg, accept_modes[i]))
+					break;
+			if (i == (int)nitems(accept_modes))
+				fatalx("unknown accept mode: %s", optarg);
+			conf.cf_accept = i;
+			break;
+		case 'b':
+			backlog = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				fatalx("backlog is %s: %s", errstr, optarg);
+			break;
 		case 'd':
 			daemonize = 0;
 			break;
+		case 'e':
+			if (conf.cf_nparams == EXTRA_PARAMS)
+				fatalx("too many parameters to capture");
+			if (strlen(optarg) >= PARAM_NAMELEN)
+				fatalx("parameter name too long: %s", optarg);
+			conf.cf_params[conf.cf_nparams++] = optarg;
+			break;
 		case 'j':
 			children = strtonum(optarg, 1, MAX_CHILDREN, &errstr);
 			if (errstr)
 				fatalx("number of children is %s: %s",
 				    errstr, optarg);
 			break;
+		case 'M':
+			conf.cf_image = 1;
+			break;
+		case 'm':
+			maxchildren = strtonum(optarg, 1, MAX_CHILDREN,
+			    &errstr);
+			if (errstr)
+				fatalx("max number of children is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'n':
+			conf.cf_search_limit = strtonum(optarg, 1,
+			    SEARCH_LIMIT_MAX, &errstr);
+			if (errstr)
+				fatalx("number of results is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'p':
 			root = optarg;
 			break;
+		case 'r':
+			conf.cf_recsize = strtonum(optarg, RECORD_SIZE_MIN,
+			    RECORD_SIZE_MAX, &errstr);
+			if (errstr)
+				fatalx("record size is %s: %s", errstr,
+				    optarg);
+			break;
 		case 'S':
 			server = 1;
 			break;
@@ -246,6 +1216,13 @@ main(int argc, char **argv)
 		case 'v':
 			verbosity++;
 			break;
+		case 'w':
+			conf.cf_workers = strtonum(optarg, 1, WORKERS_MAX,
+			    &errstr);
+			if (errstr)
+				fatalx("number of threads is %s: %s", errstr,
+				    optarg);
+			break;
 		default:
 			usage();
 		}
@@ -258,6 +1235,11 @@ main(int argc, char **argv)
 	if (argc == 1)
 		db = argv[0];
 
+	if (maxchildren == 0)
+		maxchildren = children;
+	if (maxchildren < children)
+		fatalx("max number of children is less than %d", children);
+
 	if (geteuid())
 		fatalx("need root privileges");
 
@@ -273,6 +1255,14 @@ main(int argc, char **argv)
 	if (!server) {
 		int ret;
 
+#if !HAVE_MEMFD
+		if (conf.cf_image) {
+			log_warnx("in-memory database not supported, using"
+			    " the file");
+			conf.cf_image = 0;
+		}
+#endif
+
 		ret = snprintf(path, sizeof(path), "%s/%s", root, sock);
 		if (ret < 0 || (size_t)ret >= sizeof(path))
 			fatalx("socket path too long");
@@ -280,18 +1270,45 @@ main(int argc, char **argv)
 		if ((fd = bind_socket(path, pw)) == -1)
 			fatalx("failed to open socket %s", sock);
 
+		/* before forking, so that we stay the children's parent */
+		if (daemonize && daemon(1, 0) == -1)
+			fatal("daemon");
+
+		if (conf.cf_image) {
+			ret = snprintf(path, sizeof(path), "%s/%s", root, db);
+			if (ret < 0 || (size_t)ret >= sizeof(path))
+				fatalx("database path too long");
+			if ((image_fd = image_load(path)) == -1)
+				fatalx("can't load %s in memory", path);
+		}
+
+		for (i = 0; i < maxchildren; ++i) {
+			procs[i].p_pid = -1;
+			procs[i].p_fd = -1;
+		}
+
 		for (i = 0; i < children; ++i) {
-			int d;
+			int d = -1;
 
-			if ((d = dup(fd)) == -1)
+			if (conf.cf_accept != ACCEPT_DISPATCH &&
+			    (d = dup(fd)) == -1)
 				fatalx("dup");
-			pids[i] = start_child(root, user, db,
-			    daemonize, verbosity, d);
+			if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+			    SOCK_CLOEXEC, 0, sp) == -1)
+				fatal("socketpair");
+
+			procs[i].p_fd = sp[0];
+			procs[i].p_pid = start_child(root, user, db,
+			    daemonize, verbosity, d, sp[1]);
+			procs[i].p_started = time(NULL);
 			log_debug("forking child %d (pid %lld)", i,
-			    (long long)pids[i]);
+			    (long long)procs[i].p_pid);
 		}
+		nprocs = children;
 
-		signal(SIGCHLD, handle_sigchld);
+		/* kept around for the children we'll have to respawn */
+		listenfd = fd;
+		dbname = db;
 	}
 
 	if (chroot(root) == -1)
@@ -310,35 +1327,55 @@ main(int argc, char **argv)
 	if (server)
 		exit(server_main(db));
 
-	if (daemonize && daemon(1, 0) == -1)
-		fatal("daemon");
-
-	if (pledge("stdio proc", NULL) == -1)
+	/* respawned children pledge themselves from here */
+	if (conf.cf_accept == ACCEPT_DISPATCH || conf.cf_image) {
+		if (pledge("stdio rpath flock unix proc sendfd recvfd",
+		    NULL) == -1)
+			fatal("pledge");
+	} else if (pledge("stdio rpath flock unix proc", NULL) == -1)
 		fatal("pledge");
 
-	for (;;) {
-		do {
-			pid = waitpid(WAIT_ANY, &status, 0);
-		} while (pid != -1 || errno == EINTR);
+	evbase = event_init();
 
-		if (pid == -1) {
-			if (errno == ECHILD)
-				break;
-			fatal("waitpid failed");
-		}
+	signal_set(&sigchld, SIGCHLD, handle_sigchld, NULL);
+	signal_set(&sighup, SIGHUP, handle_signal, NULL);
+	signal_set(&sigusr1, SIGUSR1, handle_signal, NULL);
+	signal_set(&sigint, SIGINT, handle_sigterm, NULL);
+	signal_set(&sigterm, SIGTERM, handle_sigterm, NULL);
+	signal_add(&sigchld, NULL);
+	signal_add(&sighup, NULL);
+	signal_add(&sigusr1, NULL);
+	signal_add(&sigint, NULL);
+	signal_add(&sigterm, NULL);
 
-		if (WIFSIGNALED(status))
-			cause = "was terminated";
-		else if (WIFEXITED(status)) {
-			if (WEXITSTATUS(status) != 0)
-				cause = "exited abnormally";
-			else
-				cause = "exited successfully";
-		} else
-			cause = "died";
+	for (i = 0; i < maxchildren; ++i) {
+		evtimer_set(&procs[i].p_timer, proc_respawn, &procs[i]);
+		if (procs[i].p_pid == -1)
+			continue;
+		event_set(&procs[i].p_ev, procs[i].p_fd, EV_READ | EV_PERSIST,
+		    proc_read, &procs[i]);
+		event_add(&procs[i].p_ev, NULL);
+	}
 
-		log_warnx("child process %lld %s", (long long)pid, cause);
+	evtimer_set(&roll_ev, roll_timeout, NULL);
+	watch_init();
+
+	if (maxchildren > children) {
+		evtimer_set(&pool_ev, pool_adjust, NULL);
+		pool_adjust(-1, EV_TIMEOUT, NULL);
 	}
 
-	return (1);
+	if (conf.cf_accept == ACCEPT_DISPATCH) {
+		event_set(&accept_ev, listenfd, EV_READ | EV_PERSIST,
+		    dispatch_accept, NULL);
+		event_add(&accept_ev, NULL);
+		evtimer_set(&accept_pause, dispatch_accept, NULL);
+	}
+
+	/* in case a child exited before the handler was in place */
+	handle_sigchld(SIGCHLD, EV_SIGNAL, NULL);
+
+	event_dispatch();
+	log_info("exiting");
+	return (0);
 }
@@ -14,15 +14,27 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/tree.h>
 
 #include <ctype.h>
+#include <errno.h>
 #include <event.h>
+#include <fcntl.h>
 #include <fnmatch.h>
 #include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sqlite3.h>
@@ -40,20 +52,46 @@
 
 char		dbpath[PATH_MAX];
 
+extern volatile int	fcgi_inflight;
+
+/* the new database is opened by a thread and handed back on the pipe */
+static int		reload_pipe[2];
+static struct event	reload_ev;
+static int		reloading;
+static int		reload_again;	/* asked again while reloading */
+static struct timespec	reload_start;
+
+/* time for the caches to get back to the hit ratio before the reload */
+static int		warm_ratio;	/* permille */
+static int		warming;
+
 void		server_sig_handler(int, short, void *);
+void		server_report(int, short, void *);
+void		server_warmup(struct env *, struct timespec *);
+void		server_drain_check(int, short, void *);
 void		server_open_db(struct env *);
+void		server_reload(struct env *);
+void		server_reload_done(int, short, void *);
 void		server_close_db(struct env *);
 __dead void	server_shutdown(struct env *);
+void		server_stats(struct env *);
 int		server_reply(struct client *, int, const char *);
+int		server_cache_lookup(struct cache *, struct client *,
+		    const char *);
+int		server_cache_end(struct client *, int);
+sqlite3_stmt	*server_stmt_acquire(struct env *, struct client *, int);
+void		 server_stmt_release(struct env *, struct client *);
 
 int		route_dispatch(struct env *, struct client *);
 int		route_home(struct env *, struct client *);
 int		route_search(struct env *, struct client *);
+void		route_search_done(struct job *);
+int		route_search_rows(struct env *, struct client *);
 int		route_categories(struct env *, struct client *);
 int		route_listing(struct env *, struct client *);
+int		route_listing_rows(struct env *, struct client *);
 int		route_port(struct env *, struct client *);
-
-typedef int (*route_t)(struct env *, struct client *);
+int		route_port_body(struct env *, struct client *);
 
 static const struct route {
 	const char	*r_path;
@@ -61,6 +99,7 @@ static const struct route {
 } routes[] = {
 	{ "/",		route_home },
 	{ "/search",	route_search },
+	{ "/search/*",	route_search },
 	{ "/all",	route_categories },
 	{ "/*",		route_port },
 };
@@ -77,80 +116,509 @@ server_sig_handler(int sig, short ev, void *arg)
 
 	switch (sig) {
 	case SIGHUP:
-		log_info("re-opening the db");
-		server_close_db(env);
-		server_open_db(env);
+		server_reload(env);
+		break;
+	case SIGUSR1:
+		server_stats(env);
 		break;
-	case SIGTERM:
 	case SIGINT:
-		server_shutdown(env);
+		/* a second one doesn't wait */
+		if (env->env_draining)
+			server_shutdown(env);
+		/* FALLTHROUGH */
+	case SIGTERM:
+		server_drain(env);
 		break;
 	default:
 		fatalx("unexpected signal %d", sig);
 	}
 }
 
-static inline void
+static const char *queries[Q_MAX] = {
+	/* ?2 and ?3 are the keyset cursor, ?4 the page size */
+	[Q_SEARCH] =
+	    "select webpkg_fts.pkgstem, webpkg_fts.comment, paths.fullpkgpath,"
+	    "       bm25(webpkg_fts), webpkg_fts.rowid"
+	    " from webpkg_fts"
+	    " join _ports p on p.fullpkgpath = webpkg_fts.id"
+	    " join _paths paths on paths.id = webpkg_fts.id"
+	    " where webpkg_fts match ?1"
+	    "   and (?2 is null"
+	    "        or bm25(webpkg_fts) > ?2"
+	    "        or (bm25(webpkg_fts) = ?2 and webpkg_fts.rowid > ?3))"
+	    " order by bm25(webpkg_fts), webpkg_fts.rowid"
+	    " limit ?4",
+
+	[Q_FULLPKGPATH] =
+	    "select p.fullpkgpath, pp.pkgstem, pp.comment, pp.pkgname,"
+	    "       d.value, e.value, r.value, pp.homepage"
+	    " from _paths p"
+	    " join _descr d on d.fullpkgpath = p.id"
+	    " join _ports pp on pp.fullpkgpath = p.id"
+	    " join _email e on e.keyref = pp.maintainer"
+	    " left join _readme r on r.fullpkgpath = p.id"
+	    " where p.fullpkgpath = ?",
+
+	[Q_CATS] =
+	    "select distinct value from categories order by value",
+
+	[Q_BYCAT] =
+	    "select fullpkgpath from categories where value = ?"
+	    " order by fullpkgpath",
+};
+
+/*
+ * With -M the parent loads the database in a sealed memfd and every
+ * connection of every child reads the pages straight out of the same
+ * mapping.  The image of the previous generation stays mapped until
+ * the last connection using it is closed.
+ */
+struct image {
+	unsigned char	*img_base;
+	size_t		 img_len;
+	int		 img_refs;
+};
+
+static pthread_mutex_t	 image_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct image	*image_cur;	/* for the new connections */
+static struct image	*image_next;	/* being opened by the reload */
+static struct image	*image_queued;	/* for the reload after that */
+
+static struct image *
+image_map(int fd)
+{
+	struct image	*img;
+	struct stat	 sb;
+	void		*p;
+
+	if (fstat(fd, &sb) == -1) {
+		log_warn("%s: fstat", __func__);
+		close(fd);
+		return (NULL);
+	}
+
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		log_warn("%s: mmap", __func__);
+		return (NULL);
+	}
+
+	if ((img = calloc(1, sizeof(*img))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		munmap(p, sb.st_size);
+		return (NULL);
+	}
+	img->img_base = p;
+	img->img_len = sb.st_size;
+	img->img_refs = 1;
+	return (img);
+}
+
+static struct image *
+image_ref(struct image *img)
+{
+	pthread_mutex_lock(&image_mtx);
+	if (img == NULL)
+		img = image_cur;
+	if (img != NULL)
+		img->img_refs++;
+	pthread_mutex_unlock(&image_mtx);
+	return (img);
+}
+
+static void
+image_unref(struct image *img)
+{
+	int		 last;
+
+	if (img == NULL)
+		return;
+
+	pthread_mutex_lock(&image_mtx);
+	last = --img->img_refs == 0;
+	pthread_mutex_unlock(&image_mtx);
+
+	if (last) {
+		munmap(img->img_base, img->img_len);
+		free(img);
+	}
+}
+
+/*
+ * Open a connection to the database file, or to img if not NULL.
+ */
+static int
+db_connect(sqlite3 **handle, struct image *img)
+{
+	char		 sql[64];
+	int		 err;
+
+	if (img == NULL)
+		return (sqlite3_open_v2(dbpath, handle, SQLITE_OPEN_READONLY,
+		    NULL));
+
+	err = sqlite3_open_v2(":memory:", handle, SQLITE_OPEN_READONLY,
+	    NULL);
+	if (err == SQLITE_OK)
+		err = sqlite3_deserialize(*handle, "main", img->img_base,
+		    img->img_len, img->img_len, SQLITE_DESERIALIZE_READONLY);
+
+	/* reference the pages in the image instead of copying them */
+	(void)snprintf(sql, sizeof(sql), "pragma mmap_size = %zu",
+	    img->img_len);
+	if (err == SQLITE_OK)
+		err = sqlite3_exec(*handle, sql, NULL, NULL, NULL);
+	return (err);
+}
+
+/*
+ * Connect to the database the way this process is configured to,
+ * for the worker threads.
+ */
+int
+server_connect(sqlite3 **handle, struct image **img)
+{
+	int		 err;
+
+	*img = conf.cf_image ? image_ref(NULL) : NULL;
+	if ((err = db_connect(handle, *img)) != SQLITE_OK) {
+		sqlite3_close(*handle);
+		*handle = NULL;
+		image_unref(*img);
+		*img = NULL;
+	}
+	return (err);
+}
+
+void
+server_disconnect(sqlite3 *handle, struct image *img)
+{
+	sqlite3_close(handle);
+	image_unref(img);
+}
+
+static inline int
 loadstmt(sqlite3 *db, sqlite3_stmt **stmt, const char *sql)
 {
 	int		 err;
 
 	err = sqlite3_prepare_v2(db, sql, -1, stmt, NULL);
-	if (err != SQLITE_OK)
-		fatalx("failed prepare statement \"%s\": %s",
+	if (err != SQLITE_OK) {
+		log_warnx("failed prepare statement \"%s\": %s",
 		    sql, sqlite3_errstr(err));
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Open the database, from img if not NULL, and prepare the statements.
+ * It's also used from the reload thread, so nothing here can touch
+ * the env.
+ */
+static struct db *
+db_open(struct image *img)
+{
+	struct db	*db;
+	sqlite3_stmt	*stmt;
+	int		 err, i;
+
+	if ((db = calloc(1, sizeof(*db))) == NULL) {
+		log_warn("calloc");
+		return (NULL);
+	}
+
+	db->db_image = image_ref(img);
+	if ((err = db_connect(&db->db_handle, db->db_image)) != SQLITE_OK) {
+		log_warnx("can't open database %s: %s", dbpath,
+		    sqlite3_errmsg(db->db_handle));
+		goto err;
+	}
+
+	/* load prepared statements */
+	for (i = 0; i < Q_MAX; ++i) {
+		if (loadstmt(db->db_handle, &db->db_stmts[i][0],
+		    queries[i]) == -1)
+			goto err;
+		db->db_nstmts[i] = 1;
+	}
+
+	/* refuse a snapshot that's truncated or empty */
+	stmt = db->db_stmts[Q_CATS][0];
+	err = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	if (err != SQLITE_ROW) {
+		log_warnx("database %s has no categories: %s", dbpath,
+		    err == SQLITE_DONE ? "empty" : sqlite3_errstr(err));
+		goto err;
+	}
+
+	return (db);
+
+ err:
+	for (i = 0; i < Q_MAX; ++i)
+		while (db->db_nstmts[i] > 0)
+			sqlite3_finalize(db->db_stmts[i][--db->db_nstmts[i]]);
+	server_disconnect(db->db_handle, db->db_image);
+	free(db);
+	return (NULL);
 }
 
 void
 server_open_db(struct env *env)
 {
-	int		 err;
+	if ((env->env_db = db_open(image_cur)) == NULL)
+		fatalx("can't use database %s", dbpath);
+	fd_recount();
+}
 
-	err = sqlite3_open_v2(dbpath, &env->env_db,
-	    SQLITE_OPEN_READONLY, NULL);
-	if (err != SQLITE_OK)
-		fatalx("can't open database %s: %s", dbpath,
-		    sqlite3_errmsg(env->env_db));
+static void
+db_free(struct db *db)
+{
+	int		 err, i;
 
-	/* load prepared statements */
-	loadstmt(env->env_db, &env->env_qsearch,
-	    "select webpkg_fts.pkgstem, webpkg_fts.comment, paths.fullpkgpath"
-	    " from webpkg_fts"
-	    " join _ports p on p.fullpkgpath = webpkg_fts.id"
-	    " join _paths paths on paths.id = webpkg_fts.id"
-	    " where webpkg_fts match ?"
-	    " order by bm25(webpkg_fts)");
+	for (i = 0; i < Q_MAX; ++i) {
+		while (db->db_nstmts[i] > 0)
+			sqlite3_finalize(db->db_stmts[i][--db->db_nstmts[i]]);
+	}
 
-	loadstmt(env->env_db, &env->env_qfullpkgpath,
-	    "select p.fullpkgpath, pp.pkgstem, pp.comment, pp.pkgname,"
-	    "       d.value, e.value, r.value, pp.homepage"
-	    " from _paths p"
-	    " join _descr d on d.fullpkgpath = p.id"
-	    " join _ports pp on pp.fullpkgpath = p.id"
-	    " join _email e on e.keyref = pp.maintainer"
-	    " left join _readme r on r.fullpkgpath = p.id"
-	    " where p.fullpkgpath = ?");
+	if ((err = sqlite3_close(db->db_handle)) != SQLITE_OK)
+		log_warnx("sqlite3_close %s", sqlite3_errstr(err));
+	image_unref(db->db_image);
+	free(db);
+	fd_recount();
+}
 
-	loadstmt(env->env_db, &env->env_qcats,
-	    "select distinct value from categories order by value");
+static void *
+server_reload_main(void *arg)
+{
+	struct db	*db;
+	ssize_t		 r;
+
+	db = db_open(arg);
+	do {
+		r = write(reload_pipe[1], &db, sizeof(db));
+	} while (r == -1 && errno == EINTR);
+	if (r != sizeof(db))
+		fatal("%s: write", __func__);
+	return (NULL);
+}
 
-	loadstmt(env->env_db, &env->env_qbycat,
-	    "select fullpkgpath from categories where value = ?"
-	    " order by fullpkgpath");
+/*
+ * Open the database again without blocking the event loop.  Requests
+ * keep using the current one until the new one is ready.
+ */
+void
+server_reload(struct env *env)
+{
+	pthread_t	 t;
+	sigset_t	 set, oset;
+
+	/* the reply comes from the one after the current reload */
+	if (reloading) {
+		log_info("the db is already being re-opened, will do it again");
+		reload_again = 1;
+		return;
+	}
+
+	log_info("re-opening the db");
+	clock_gettime(CLOCK_MONOTONIC, &reload_start);
+
+	sigfillset(&set);
+	if (pthread_sigmask(SIG_BLOCK, &set, &oset) != 0)
+		fatalx("pthread_sigmask");
+	if (pthread_create(&t, NULL, server_reload_main,
+	    image_next != NULL ? image_next : image_cur) != 0) {
+		log_warnx("%s: pthread_create", __func__);
+		pthread_sigmask(SIG_SETMASK, &oset, NULL);
+		image_unref(image_next);
+		image_next = NULL;
+		ctl_send(CTL_RELOADED, -1);
+		return;
+	}
+	pthread_detach(t);
+	if (pthread_sigmask(SIG_SETMASK, &oset, NULL) != 0)
+		fatalx("pthread_sigmask");
+	reloading = 1;
+}
+
+/*
+ * The parent sent a new image of the database to switch to.
+ */
+void
+server_image(struct env *env, int fd)
+{
+	struct image	*img;
+
+	if ((img = image_map(fd)) == NULL) {
+		ctl_send(CTL_RELOADED, -1);
+		return;
+	}
+
+	if (reloading) {
+		image_unref(image_queued);
+		image_queued = img;
+	} else
+		image_next = img;
+	server_reload(env);
+}
+
+/*
+ * Start the reload that was asked for while the last one was
+ * running, if any.
+ */
+static int
+server_reload_again(struct env *env)
+{
+	if (!reload_again)
+		return (0);
+	reload_again = 0;
+	image_next = image_queued;
+	image_queued = NULL;
+	server_reload(env);
+	return (1);
+}
+
+/*
+ * Swap in the new database.  The old one is closed once the suspended
+ * clients give back its last statement.
+ */
+void
+server_reload_done(int fd, short ev, void *arg)
+{
+	struct env	*env = arg;
+	struct db	*db;
+	struct image	*old;
+	struct timespec	 now;
+	long long	 ms;
+	ssize_t		 r;
+
+	do {
+		r = read(fd, &db, sizeof(db));
+	} while (r == -1 && errno == EINTR);
+	if (r == -1 && errno == EAGAIN)
+		return;
+	if (r != sizeof(db))
+		fatal("%s: read", __func__);
+	reloading = 0;
+
+	if (db == NULL) {
+		log_warnx("can't re-open the db, keeping the old one");
+		image_unref(image_next);
+		image_next = NULL;
+		if (!server_reload_again(env))
+			ctl_send(CTL_RELOADED, -1);
+		return;
+	}
+
+	if (image_next != NULL) {
+		pthread_mutex_lock(&image_mtx);
+		old = image_cur;
+		image_cur = image_next;
+		pthread_mutex_unlock(&image_mtx);
+		image_next = NULL;
+		image_unref(old);
+	}
+
+	/* the hit ratio up to now is the one to get back to */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	server_warmup(env, &now);
+
+	cache_clear(&env->env_static);
+	cache_clear(&env->env_pagecache);
+	cache_clear(&env->env_searchcache);
+	server_close_db(env);
+	env->env_db = db;
+	fd_recount();
+	worker_reload();
+
+	ms = (now.tv_sec - reload_start.tv_sec) * 1000LL +
+	    (now.tv_nsec - reload_start.tv_nsec) / 1000000;
+	log_info("db re-opened in %lld ms", ms);
+	if (server_reload_again(env))
+		return;
+	ctl_send(CTL_RELOADED, ms);
+
+	/* server_report tells when the caches are warm again */
+	reload_start = now;
+	warming = warm_ratio > 0;
+	if (!warming)
+		ctl_send(CTL_WARM, 0);
 }
 
 void
 server_close_db(struct env *env)
 {
+	struct db	*db = env->env_db;
+
+	env->env_db = NULL;
+
+	/*
+	 * Suspended clients may still hold some statements: in that
+	 * case the connection is closed in server_stmt_release once
+	 * the last one is given back.
+	 */
+	if (db->db_refs > 0)
+		log_debug("%s: deferring close, %d statements in use",
+		    __func__, db->db_refs);
+	else
+		db_free(db);
+}
+
+/*
+ * Give the client a statement for the query q, preparing a new one
+ * if all the cached ones are in use by suspended clients.
+ */
+sqlite3_stmt *
+server_stmt_acquire(struct env *env, struct client *clt, int q)
+{
+	struct db	*db = env->env_db;
+	sqlite3_stmt	*stmt;
 	int		 err;
 
-	sqlite3_finalize(env->env_qsearch);
-	sqlite3_finalize(env->env_qfullpkgpath);
-	sqlite3_finalize(env->env_qcats);
-	sqlite3_finalize(env->env_qbycat);
+	if (db->db_nstmts[q] > 0)
+		stmt = db->db_stmts[q][--db->db_nstmts[q]];
+	else {
+		err = sqlite3_prepare_v2(db->db_handle, queries[q], -1, &stmt,
+		    NULL);
+		if (err != SQLITE_OK) {
+			log_warnx("%s: sqlite3_prepare_v2: %s", __func__,
+			    sqlite3_errstr(err));
+			return (NULL);
+		}
+	}
 
-	if ((err = sqlite3_close(env->env_db)) != SQLITE_OK)
-		log_warnx("sqlite3_close %s", sqlite3_errstr(err));
+	db->db_refs++;
+	clt->clt_db = db;
+	clt->clt_stmt = stmt;
+	clt->clt_stmtq = q;
+	return (stmt);
+}
+
+void
+server_stmt_release(struct env *env, struct client *clt)
+{
+	struct db	*db = clt->clt_db;
+	sqlite3_stmt	*stmt = clt->clt_stmt;
+	int		 q = clt->clt_stmtq;
+
+	if (stmt == NULL)
+		return;
+	clt->clt_db = NULL;
+	clt->clt_stmt = NULL;
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	if (db->db_nstmts[q] == STMT_CACHE)
+		sqlite3_finalize(stmt);
+	else
+		db->db_stmts[q][db->db_nstmts[q]++] = stmt;
+
+	/* the last statement of a connection replaced on SIGHUP */
+	if (--db->db_refs == 0 && db != env->env_db)
+		db_free(db);
 }
 
 int
@@ -160,36 +628,72 @@ server_main(const char *db)
 	struct event	 sighup;
 	struct event	 sigint;
 	struct event	 sigterm;
+	struct event	 sigusr1;
 
 	signal(SIGPIPE, SIG_IGN);
 
 	memset(&env, 0, sizeof(env));
-
-	if (pledge("stdio rpath flock unix", NULL) == -1)
+	cache_init(&env.env_static, "static", STATICCACHE_ENTRIES,
+	    STATICCACHE_SIZE);
+	cache_init(&env.env_pagecache, "page", PAGECACHE_ENTRIES,
+	    PAGECACHE_SIZE);
+	cache_init(&env.env_searchcache, "search", SEARCHCACHE_ENTRIES,
+	    SEARCHCACHE_SIZE);
+
+	if (conf.cf_accept == ACCEPT_DISPATCH || conf.cf_image) {
+		if (pledge("stdio rpath flock unix recvfd", NULL) == -1)
+			fatal("pledge");
+	} else if (pledge("stdio rpath flock unix", NULL) == -1)
 		fatal("pledge");
 
 	if (realpath(db, dbpath) == NULL)
 		fatal("realpath %s", db);
 
+	if (conf.cf_image && (image_cur = image_map(IMAGE_FD)) == NULL)
+		fatalx("can't map the database image");
+
 	server_open_db(&env);
 
 	event_init();
 
-	env.env_sockfd = 3;
-
-	event_set(&env.env_sockev, env.env_sockfd, EV_READ | EV_PERSIST,
-	    fcgi_accept, &env);
+	worker_init(dbpath, queries[Q_SEARCH], conf.cf_workers);
+
+	if (pipe(reload_pipe) == -1)
+		fatal("pipe");
+	if (fcntl(reload_pipe[0], F_SETFL, O_NONBLOCK) == -1)
+		fatal("fcntl");
+	event_set(&reload_ev, reload_pipe[0], EV_READ | EV_PERSIST,
+	    server_reload_done, &env);
+	event_add(&reload_ev, NULL);
+
+	if (conf.cf_accept == ACCEPT_DISPATCH) {
+		env.env_sockfd = -1;
+		event_set(&env.env_sockev, CTL_FD, EV_READ | EV_PERSIST,
+		    fcgi_recv, &env);
+	} else {
+		env.env_sockfd = 3;
+		event_set(&env.env_sockev, env.env_sockfd,
+		    EV_READ | EV_PERSIST, fcgi_accept, &env);
+		event_set(&env.env_ctlev, CTL_FD, EV_READ | EV_PERSIST,
+		    fcgi_recv, &env);
+		event_add(&env.env_ctlev, NULL);
+	}
 	event_add(&env.env_sockev, NULL);
 
+	evtimer_set(&env.env_reportev, server_report, &env);
+	server_report(-1, EV_TIMEOUT, &env);
+
 	evtimer_set(&env.env_pausev, fcgi_accept, &env);
 
 	signal_set(&sighup, SIGHUP, server_sig_handler, &env);
 	signal_set(&sigint, SIGINT, server_sig_handler, &env);
 	signal_set(&sigterm, SIGTERM, server_sig_handler, &env);
+	signal_set(&sigusr1, SIGUSR1, server_sig_handler, &env);
 
 	signal_add(&sighup, NULL);
 	signal_add(&sigint, NULL);
 	signal_add(&sigterm, NULL);
+	signal_add(&sigusr1, NULL);
 
 	log_info("ready");
 	event_dispatch();
@@ -197,6 +701,147 @@ server_main(const char *db)
 	server_shutdown(&env);
 }
 
+/*
+ * Compare the hit ratio of the caches over the last interval with the
+ * one before the reload, and log how long it took to get there again.
+ */
+void
+server_warmup(struct env *env, struct timespec *now)
+{
+	static unsigned long long	 last_hits, last_lookups;
+	unsigned long long		 hits, lookups;
+	long long			 ms;
+	int				 ratio;
+
+	hits = env->env_static.c_hits + env->env_pagecache.c_hits +
+	    env->env_searchcache.c_hits;
+	lookups = hits + env->env_static.c_misses +
+	    env->env_pagecache.c_misses + env->env_searchcache.c_misses;
+
+	ms = (now->tv_sec - reload_start.tv_sec) * 1000LL +
+	    (now->tv_nsec - reload_start.tv_nsec) / 1000000;
+
+	if (lookups > last_lookups) {
+		ratio = (hits - last_hits) * 1000 / (lookups - last_lookups);
+		if (!warming)
+			warm_ratio = ratio;
+		else if (ratio >= warm_ratio * 9 / 10) {
+			warming = 0;
+			log_info("caches warmed up in %lld ms, %d%% hits",
+			    ms, ratio / 10);
+			ctl_send(CTL_WARM, ms);
+		}
+	} else if (warming) {
+		/* no traffic, nothing to warm up for */
+		warming = 0;
+		ctl_send(CTL_WARM, ms);
+	}
+	last_hits = hits;
+	last_lookups = lookups;
+}
+
+/*
+ * Let the parent know how busy we are and the connections in flight.
+ * Busy is the share of the last interval the main thread spent on the
+ * cpu, or the one of all the threads together if higher, so that it
+ * stays within 1000 whatever the number of workers.  Time spent
+ * waiting for the disk shows up as connections piling up instead.
+ */
+void
+server_report(int fd, short ev, void *arg)
+{
+	struct env		*env = arg;
+	struct timeval		 tv = { REPORT_INTERVAL, 0 };
+	struct rusage		 ru;
+	struct timespec		 now, ts;
+	static long long	 last_cpu, last_thr, last_wall;
+	long long		 cpu, thr, wall, busy, all;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		fatal("getrusage");
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == -1)
+		fatal("clock_gettime");
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	cpu = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL +
+	    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+	thr = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+	wall = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+
+	if (last_wall != 0 && wall > last_wall) {
+		busy = (thr - last_thr) * 1000 / (wall - last_wall);
+		all = (cpu - last_cpu) * 1000 / (wall - last_wall) /
+		    (1 + conf.cf_workers);
+		ctl_send(CTL_BUSY, busy > all ? busy : all);
+		ctl_send(CTL_LOAD, fcgi_inflight);
+	}
+	last_cpu = cpu;
+	last_thr = thr;
+	last_wall = wall;
+
+	server_warmup(env, &now);
+
+	evtimer_add(&env->env_reportev, &tv);
+}
+
+/*
+ * Stop taking new connections and exit once the requests in progress
+ * are done, or DRAIN_TIMEOUT seconds later.
+ */
+void
+server_drain(struct env *env)
+{
+	struct timespec		 now;
+
+	if (env->env_draining)
+		return;
+	env->env_draining = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	env->env_drain_by = now.tv_sec + DRAIN_TIMEOUT;
+
+	log_info("draining connections");
+	fcgi_drain(env);
+
+	/* in dispatch mode the parent just stops sending them */
+	if (conf.cf_accept != ACCEPT_DISPATCH) {
+		event_del(&env->env_sockev);
+		evtimer_del(&env->env_pausev);
+	}
+
+	evtimer_set(&env->env_drainev, server_drain_check, env);
+	server_drain_check(-1, EV_TIMEOUT, env);
+}
+
+void
+server_drain_check(int fd, short ev, void *arg)
+{
+	struct env		*env = arg;
+	struct timeval		 tv = { 0, 100000 };
+	struct timespec		 now;
+	int			 n;
+
+	if (fcgi_idle(env))
+		server_shutdown(env);
+
+	/*
+	 * Past the deadline end what's left, and allow one more second
+	 * for the replies to be flushed.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec >= env->env_drain_by + 1)
+		server_shutdown(env);
+	if (now.tv_sec >= env->env_drain_by && env->env_draining == 1) {
+		env->env_draining = 2;
+		if ((n = fcgi_end_all(env)) > 0)
+			log_warnx("drain timeout, ended %d requests", n);
+		if (fcgi_idle(env))
+			server_shutdown(env);
+	}
+
+	evtimer_add(&env->env_drainev, &tv);
+}
+
 void __dead
 server_shutdown(struct env *env)
 {
@@ -205,6 +850,15 @@ server_shutdown(struct env *env)
 	exit(0);
 }
 
+void
+server_stats(struct env *env)
+{
+	cache_stats(&env->env_static);
+	cache_stats(&env->env_pagecache);
+	cache_stats(&env->env_searchcache);
+	fcgi_stats();
+}
+
 int
 server_reply(struct client *clt, int status, const char *ctype)
 {
@@ -216,22 +870,75 @@ server_reply(struct client *clt, int status, const char *ctype)
 int
 server_handle(struct env *env, struct client *clt)
 {
+	int		 i;
+
 	log_debug("SCRIPT_NAME %s", clt->clt_script_name);
 	log_debug("PATH_INFO   %s", clt->clt_path_info);
+	for (i = 0; i < conf.cf_nparams; ++i)
+		log_debug("%s %s", conf.cf_params[i],
+		    clt->clt_params[i] ? clt->clt_params[i] : "-");
 	return (route_dispatch(env, clt));
 }
 
+/*
+ * Serve the reply for key out of cache, if available.  Otherwise,
+ * start recording what's sent to the client so that server_cache_end
+ * can save it.  Returns 1 if the reply was served from the cache.
+ */
+int
+server_cache_lookup(struct cache *cache, struct client *clt, const char *key)
+{
+	uint8_t		*data;
+	size_t		 len;
+
+	if (cache_get(cache, key, &data, &len)) {
+		if (clt_write_records(clt, data, len) == -1)
+			return (-1);
+		if (fcgi_end_request(clt, 0) == -1)
+			return (-1);
+		return (1);
+	}
+
+	/* don't record what was written before */
+	if (clt_flush(clt) == -1)
+		return (-1);
+
+	if ((clt->clt_cachekey = clt_strdup(clt, key)) == NULL)
+		return (0);
+	clt->clt_reclen = 0;
+	clt->clt_cache = cache;
+	clt->clt_cachegen = cache->c_gen;
+	return (0);
+}
+
+/*
+ * Like fcgi_end_request, but also save the reply in the cache when
+ * it's successful and the cache wasn't cleared in the meantime: the
+ * reply may come from the database that was just replaced.
+ */
+int
+server_cache_end(struct client *clt, int status)
+{
+	if (clt_flush(clt) == -1)
+		return (-1);
+
+	if (status == 0 && clt->clt_cache != NULL &&
+	    clt->clt_cachegen == clt->clt_cache->c_gen)
+		cache_put(clt->clt_cache, clt->clt_cachekey, clt->clt_rec,
+		    clt->clt_reclen);
+
+	return (fcgi_end_request(clt, status));
+}
+
 void
 server_client_free(struct client *clt)
 {
 #if template
 	template_free(clt->clt_tp);
 #endif
-	free(clt->clt_server_name);
-	free(clt->clt_script_name);
-	free(clt->clt_path_info);
-	free(clt->clt_query);
-	free(clt);
+	server_stmt_release(clt->clt_fcgi->fcg_env, clt);
+	if (clt->clt_job != NULL)
+		worker_cancel(clt->clt_job);
 }
 
 static inline int
@@ -313,6 +1020,172 @@ fts_escape(const char *p, char *buf, size_t bufsize)
 	return (-1);
 }
 
+/*
+ * Turn the output of fts_escape into a canonical form, suitable to
+ * be used as a cache key: the terms are separated by a single space,
+ * duplicates are dropped and ASCII letters are lowercased, as the
+ * unicode61 tokenizer is case-insensitive anyway.  This doesn't
+ * change the set of matching rows, but it's the canonical form that
+ * is run, so a term given more than once no longer weighs more in the
+ * bm25 ranking.  That keeps the cached results and the cursors of the
+ * next pages consistent with the query actually run.
+ */
+static inline void
+fts_canon(char *q)
+{
+	char		*p, *e, *t, *out, *sp;
+	size_t		 i, len, tlen;
+	int		 dup;
+
+	p = out = q;
+	for (;;) {
+		p += strspn(p, " ");
+		if (*p != '"')
+			break;
+
+		/* find the closing quote, skipping the doubled ones */
+		for (e = p + 1; *e != '\0'; ++e) {
+			if (*e != '"')
+				continue;
+			if (e[1] != '"')
+				break;
+			e++;
+		}
+		if (*e == '\0')
+			break;
+		len = e - p + 1;
+
+		for (i = 0; i < len; ++i)
+			if (p[i] >= 'A' && p[i] <= 'Z')
+				p[i] += 'a' - 'A';
+
+		dup = 0;
+		for (t = q; t < out; t += tlen + 1) {
+			if ((sp = memchr(t, ' ', out - t)) == NULL)
+				sp = out;
+			tlen = sp - t;
+			if (tlen == len && !memcmp(t, p, len)) {
+				dup = 1;
+				break;
+			}
+		}
+
+		if (!dup) {
+			if (out != q)
+				*out++ = ' ';
+			memmove(out, p, len);
+			out += len;
+		}
+		p = e + 1;
+	}
+	*out = '\0';
+}
+
+/*
+ * Build a query string out of a canonical fts query that, once
+ * escaped, results in the same query.
+ */
+static inline int
+fts_query_link(const char *q, char *buf, size_t bufsize)
+{
+	const char	*hex = "0123456789ABCDEF";
+	char		 ch;
+	int		 quoted = 0;
+
+	for (; *q != '\0'; ++q) {
+		ch = *q;
+		if (ch == '"') {
+			if (quoted && q[1] == '"')
+				q++;	/* un-double the quote */
+			else {
+				quoted = !quoted;
+				continue;
+			}
+		}
+
+		if (isalnum((unsigned char)ch) || strchr("-._~", ch)) {
+			if (bufsize < 2)
+				return (-1);
+			*buf++ = ch;
+			bufsize--;
+			continue;
+		}
+
+		if (bufsize < 4)
+			return (-1);
+		*buf++ = '%';
+		*buf++ = hex[(unsigned char)ch >> 4];
+		*buf++ = hex[(unsigned char)ch & 0xF];
+		bufsize -= 3;
+	}
+
+	if (bufsize == 0)
+		return (-1);
+	*buf = '\0';
+	return (0);
+}
+
+/*
+ * The search cursor is the bm25 score and rowid of the last row of
+ * the previous page, encoded as "bits.rowid" in hex, so that it
+ * round-trips exactly and disambiguates between equal scores.
+ */
+static inline int
+cursor_parse(const char *s, double *score, int64_t *rowid)
+{
+	unsigned long long	 bits, id;
+	char			*ep;
+
+	if (!isxdigit((unsigned char)*s))
+		return (-1);
+	errno = 0;
+	bits = strtoull(s, &ep, 16);
+	if (errno == ERANGE || *ep != '.')
+		return (-1);
+
+	s = ep + 1;
+	if (!isxdigit((unsigned char)*s))
+		return (-1);
+	id = strtoull(s, &ep, 16);
+	if (errno == ERANGE || *ep != '\0' || id > INT64_MAX)
+		return (-1);
+
+	memcpy(score, &bits, sizeof(*score));
+	if (isnan(*score))
+		return (-1);
+	*rowid = id;
+	return (0);
+}
+
+static inline const char *
+cursor_fmt(double score, int64_t rowid)
+{
+	static char		 buf[64];
+	unsigned long long	 bits;
+
+	memcpy(&bits, &score, sizeof(bits));
+	(void)snprintf(buf, sizeof(buf), "%llx.%llx", bits,
+	    (unsigned long long)rowid);
+	return (buf);
+}
+
+/*
+ * Serve the request out of the given cache using the full request
+ * path as key.  Returns like server_cache_lookup.
+ */
+static int
+route_cached(struct cache *cache, struct client *clt)
+{
+	char		 key[PATH_MAX];
+	int		 r;
+
+	r = snprintf(key, sizeof(key), "%s%s", clt->clt_script_name,
+	    clt->clt_path_info);
+	if (r < 0 || (size_t)r >= sizeof(key))
+		return (0);
+	return (server_cache_lookup(cache, clt, key));
+}
+
 int
 route_dispatch(struct env *env, struct client *clt)
 {
@@ -335,6 +1208,11 @@ route_dispatch(struct env *env, struct client *clt)
 int
 route_home(struct env *env, struct client *clt)
 {
+	int		 r;
+
+	if ((r = route_cached(&env->env_static, clt)) != 0)
+		return (r == -1 ? -1 : 0);
+
 	if (server_reply(clt, 20, "text/gemini") == -1)
 		return (-1);
 
@@ -360,17 +1238,23 @@ route_home(struct env *env, struct client *clt)
 		return (-1);
 #endif
 
-	return (fcgi_end_request(clt, 0));
+	return (server_cache_end(clt, 0));
 }
 
 int
 route_search(struct env *env, struct client *clt)
 {
-	const char	*stem, *comment, *fullpkgpath;
+	struct job	*job;
+	const char	*cursor = NULL;
 	char		*query = clt->clt_query;
 	char		 equery[1024];
-	int		 err;
-	int		 found = 0;
+	char		 key[PATH_MAX];
+	double		 score = 0;
+	int64_t		 rowid = 0;
+	int		 r;
+
+	if (!strncmp(clt->clt_path_info, "/search/", 8))
+		cursor = clt->clt_path_info + 8;
 
 	if (query == NULL || *query == '\0') {
 		if (server_reply(clt, 10, "search for a package") == -1)
@@ -379,68 +1263,123 @@ route_search(struct env *env, struct client *clt)
 	}
 
 	if (unquote(query) == -1 ||
-	    fts_escape(query, equery, sizeof(equery)) == -1) {
+	    fts_escape(query, equery, sizeof(equery)) == -1 ||
+	    (cursor != NULL && cursor_parse(cursor, &score, &rowid) == -1)) {
 		if (server_reply(clt, 59, "bad request") == -1)
 			return (-1);
 		return (fcgi_end_request(clt, 1));
 	}
+	fts_canon(equery);
 
 	log_debug("searching for %s", equery);
 
-	err = sqlite3_bind_text(env->env_qsearch, 1, equery, -1, NULL);
-	if (err != SQLITE_OK) {
-		log_warnx("%s: sqlite3_bind_text \"%s\": %s", __func__,
-		    query, sqlite3_errstr(err));
-		sqlite3_reset(env->env_qsearch);
-
+	if ((job = worker_job_new(clt, equery)) == NULL) {
+		log_warn("%s: worker_job_new", __func__);
 		if (server_reply(clt, 42, "internal error") == -1)
 			return (-1);
 		return (fcgi_end_request(clt, 1));
 	}
+	job->j_cursor = cursor != NULL;
+	job->j_score = score;
+	job->j_rowid = rowid;
+	job->j_limit = conf.cf_search_limit;
+
+	if (server_reply(clt, 20, "text/gemini") == -1 ||
+	    clt_printf(clt, "# search results for %s\n\n", query) == -1) {
+		worker_job_free(job);
+		return (-1);
+	}
 
-	if (server_reply(clt, 20, "text/gemini") == -1)
-		goto err;
+	/*
+	 * The header depends on the raw query, so only the results
+	 * are cached, keyed by the canonical form of the query and
+	 * the cursor.
+	 */
+	r = snprintf(key, sizeof(key), "%s%s?%s", clt->clt_script_name,
+	    clt->clt_path_info, equery);
+	if (r >= 0 && (size_t)r < sizeof(key) &&
+	    (r = server_cache_lookup(&env->env_searchcache, clt, key)) != 0) {
+		worker_job_free(job);
+		return (r == -1 ? -1 : 0);
+	}
 
-	if (clt_printf(clt, "# search results for %s\n\n", query) == -1)
-		goto err;
+	/* the FTS query may be slow, run it off the event loop */
+	clt->clt_job = job;
+	worker_submit(job, route_search_done);
+	return (0);
+}
 
-	for (;;) {
-		err = sqlite3_step(env->env_qsearch);
-		if (err == SQLITE_DONE)
-			break;
-		if (err != SQLITE_ROW) {
-			log_warnx("%s: sqlite3_step %s", __func__,
-			    sqlite3_errstr(err));
-			break;
+void
+route_search_done(struct job *job)
+{
+	struct client	*clt = job->j_clt;
+
+	route_search_rows(clt->clt_fcgi->fcg_env, clt);
+}
+
+int
+route_search_rows(struct env *env, struct client *clt)
+{
+	struct job	*job = clt->clt_job;
+	const char	*stem, *comment, *fullpkgpath;
+	char		 equery[1024];
+	char		 next[GEMINI_MAXLEN];
+	int		 status;
+
+	while (job->j_off < job->j_len) {
+		if (clt_congested(clt)) {
+			clt_suspend(clt, route_search_rows);
+			return (0);
 		}
-		found = 1;
 
-		stem = sqlite3_column_text(env->env_qsearch, 0);
-		comment = sqlite3_column_text(env->env_qsearch, 1);
-		fullpkgpath = sqlite3_column_text(env->env_qsearch, 2);
+		stem = job->j_rows + job->j_off;
+		comment = stem + strlen(stem) + 1;
+		fullpkgpath = comment + strlen(comment) + 1;
+		job->j_off = fullpkgpath + strlen(fullpkgpath) + 1 -
+		    job->j_rows;
 
 		if (clt_printf(clt, "=> %s/%s %s: %s\n", clt->clt_script_name,
 		    fullpkgpath, stem, comment) == -1)
-			goto err;
+			return (-1);
 	}
 
-	sqlite3_reset(env->env_qsearch);
-
-	if (!found && clt_printf(clt, "No ports found\n") == -1)
+	if (job->j_nrows == 0 && strncmp(clt->clt_path_info, "/search/", 8) &&
+	    clt_printf(clt, "No ports found\n") == -1)
 		return (-1);
 
-	return (fcgi_end_request(clt, 0));
+	/* the link is built from the canonical query to be cacheable */
+	if (job->j_more &&
+	    fts_escape(clt->clt_query, equery, sizeof(equery)) == 0) {
+		fts_canon(equery);
+		if (fts_query_link(equery, next, sizeof(next)) == 0 &&
+		    clt_printf(clt, "\n=> %s/search/%s?%s Next page\n",
+		    clt->clt_script_name,
+		    cursor_fmt(job->j_score, job->j_rowid), next) == -1)
+			return (-1);
+	}
 
- err:
-	sqlite3_reset(env->env_qsearch);
-	return (-1);
+	status = job->j_ok ? 0 : 1;
+	clt->clt_job = NULL;
+	worker_job_free(job);
+
+	return (server_cache_end(clt, status));
 }
 
 int
 route_categories(struct env *env, struct client *clt)
 {
+	sqlite3_stmt	*stmt;
 	const char	*fullpkgpath;
-	int		 err;
+	int		 err, r;
+
+	if ((r = route_cached(&env->env_static, clt)) != 0)
+		return (r == -1 ? -1 : 0);
+
+	if ((stmt = server_stmt_acquire(env, clt, Q_CATS)) == NULL) {
+		if (server_reply(clt, 42, "internal error") == -1)
+			return (-1);
+		return (fcgi_end_request(clt, 1));
+	}
 
 	if (server_reply(clt, 20, "text/gemini") == -1)
 		return (-1);
@@ -451,7 +1390,7 @@ route_categories(struct env *env, struct client *clt)
 		return (-1);
 
 	for (;;) {
-		err = sqlite3_step(env->env_qcats);
+		err = sqlite3_step(stmt);
 		if (err == SQLITE_DONE)
 			break;
 		if (err != SQLITE_ROW) {
@@ -460,36 +1399,45 @@ route_categories(struct env *env, struct client *clt)
 			break;
 		}
 
-		fullpkgpath = sqlite3_column_text(env->env_qcats, 0);
+		fullpkgpath = sqlite3_column_text(stmt, 0);
 
 		if (clt_printf(clt, "=> %s/%s %s\n", clt->clt_script_name,
-		    fullpkgpath, fullpkgpath) == -1) {
-			sqlite3_reset(env->env_qcats);
+		    fullpkgpath, fullpkgpath) == -1)
 			return (-1);
-		}
+		clt->clt_count++;
 	}
 
-	sqlite3_reset(env->env_qcats);
-	return (fcgi_end_request(clt, 0));
+	/* any unknown path ends up here, don't let them evict real pages */
+	if (clt->clt_count == 0)
+		clt->clt_cache = NULL;
+
+	server_stmt_release(env, clt);
+	return (server_cache_end(clt, err == SQLITE_DONE ? 0 : 1));
 }
 
 int
 route_listing(struct env *env, struct client *clt)
 {
+	sqlite3_stmt	*stmt;
 	char		 buf[128], *s;
 	const char	*path = clt->clt_path_info + 1;
-	const char	*fullpkgpath;
 	int		 err;
 
 	strlcpy(buf, path, sizeof(buf));
 	while ((s = strrchr(buf, '/')) != NULL)
 		*s = '\0';
 
-	err = sqlite3_bind_text(env->env_qbycat, 1, buf, -1, NULL);
+	if ((stmt = server_stmt_acquire(env, clt, Q_BYCAT)) == NULL) {
+		if (server_reply(clt, 42, "internal error") == -1)
+			return (-1);
+		return (fcgi_end_request(clt, 1));
+	}
+
+	err = sqlite3_bind_text(stmt, 1, buf, -1, SQLITE_TRANSIENT);
 	if (err != SQLITE_OK) {
 		log_warnx("%s: sqlite3_bind_text \"%s\": %s", __func__,
 		    path, sqlite3_errstr(err));
-		sqlite3_reset(env->env_qbycat);
+		server_stmt_release(env, clt);
 
 		if (server_reply(clt, 42, "internal error") == -1)
 			return (-1);
@@ -497,13 +1445,29 @@ route_listing(struct env *env, struct client *clt)
 	}
 
 	if (server_reply(clt, 20, "text/gemini") == -1)
-		goto err;
+		return (-1);
 
 	if (clt_printf(clt, "# port(s) under %s\n\n", path) == -1)
-		goto err;
+		return (-1);
+
+	clt->clt_count = 0;
+	return (route_listing_rows(env, clt));
+}
+
+int
+route_listing_rows(struct env *env, struct client *clt)
+{
+	sqlite3_stmt	*stmt = clt->clt_stmt;
+	const char	*fullpkgpath;
+	int		 err;
 
 	for (;;) {
-		err = sqlite3_step(env->env_qbycat);
+		if (clt_congested(clt)) {
+			clt_suspend(clt, route_listing_rows);
+			return (0);
+		}
+
+		err = sqlite3_step(stmt);
 		if (err == SQLITE_DONE)
 			break;
 		if (err != SQLITE_ROW) {
@@ -512,21 +1476,20 @@ route_listing(struct env *env, struct client *clt)
 			break;
 		}
 
-		fullpkgpath = sqlite3_column_text(env->env_qbycat, 0);
+		fullpkgpath = sqlite3_column_text(stmt, 0);
 
 		if (clt_printf(clt, "=> %s/%s %s\n", clt->clt_script_name,
-		    fullpkgpath, fullpkgpath) == -1) {
-			sqlite3_reset(env->env_qbycat);
+		    fullpkgpath, fullpkgpath) == -1)
 			return (-1);
-		}
+		clt->clt_count++;
 	}
 
-	sqlite3_reset(env->env_qbycat);
-	return (fcgi_end_request(clt, 0));
+	/* any unknown path ends up here, don't let them evict real pages */
+	if (clt->clt_count == 0)
+		clt->clt_cache = NULL;
 
- err:
-	sqlite3_reset(env->env_qbycat);
-	return (-1);
+	server_stmt_release(env, clt);
+	return (server_cache_end(clt, err == SQLITE_DONE ? 0 : 1));
 }
 
 static int
@@ -567,97 +1530,139 @@ print_maintainer(struct client *clt, const char *mail)
 int
 route_port(struct env *env, struct client *clt)
 {
+	sqlite3_stmt	*stmt;
 	const char	*path = clt->clt_path_info + 1;
-	const char	*fullpkgpath, *stem, *pkgname, *descr;
-	const char	*comment, *maintainer, *readme, *www;
-	const char	*version;
-	int		 err;
+	int		 err, r;
+
+	if ((r = route_cached(&env->env_pagecache, clt)) != 0)
+		return (r == -1 ? -1 : 0);
+
+	if ((stmt = server_stmt_acquire(env, clt, Q_FULLPKGPATH)) == NULL) {
+		if (server_reply(clt, 42, "internal error") == -1)
+			return (-1);
+		return (fcgi_end_request(clt, 1));
+	}
 
-	err = sqlite3_bind_text(env->env_qfullpkgpath, 1, path, -1, NULL);
+	err = sqlite3_bind_text(stmt, 1, path, -1, NULL);
 	if (err != SQLITE_OK) {
 		log_warnx("%s: sqlite3_bind_text \"%s\": %s", __func__,
 		    path, sqlite3_errstr(err));
-		sqlite3_reset(env->env_qfullpkgpath);
+		server_stmt_release(env, clt);
 
 		if (server_reply(clt, 42, "internal error") == -1)
 			return (-1);
 		return (fcgi_end_request(clt, 1));
 	}
 
-	err = sqlite3_step(env->env_qfullpkgpath);
+	err = sqlite3_step(stmt);
 	if (err == SQLITE_DONE) {
 		/* No rows, retry as a category */
-		sqlite3_reset(env->env_qfullpkgpath);
+		server_stmt_release(env, clt);
 		return (route_listing(env, clt));
 	}
 
 	if (err != SQLITE_ROW) {
 		log_warnx("%s: sqlite3_step %s", __func__,
 		    sqlite3_errstr(err));
+		server_stmt_release(env, clt);
 		if (server_reply(clt, 42, "internal error") == -1)
-			goto err;
-		goto done;
+			return (-1);
+		return (fcgi_end_request(clt, 1));
 	}
 
-	fullpkgpath = sqlite3_column_text(env->env_qfullpkgpath, 0);
-	stem = sqlite3_column_text(env->env_qfullpkgpath, 1);
-	comment = sqlite3_column_text(env->env_qfullpkgpath, 2);
-	pkgname = sqlite3_column_text(env->env_qfullpkgpath, 3);
-	descr = sqlite3_column_text(env->env_qfullpkgpath, 4);
-	maintainer = sqlite3_column_text(env->env_qfullpkgpath, 5);
-	readme = sqlite3_column_text(env->env_qfullpkgpath, 6);
-	www = sqlite3_column_text(env->env_qfullpkgpath, 7);
+	clt->clt_count = 0;
+	return (route_port_body(env, clt));
+}
 
-	if ((version = strrchr(pkgname, '-')) != NULL)
-		version++;
-	else
-		version = " unknown";
+/*
+ * The page is written in sections, so that the client may be
+ * suspended in between if it's not reading fast enough.  The
+ * statement stays on the row in the meantime.
+ */
+int
+route_port_body(struct env *env, struct client *clt)
+{
+	sqlite3_stmt	*stmt = clt->clt_stmt;
+	const char	*path = clt->clt_path_info + 1;
+	const char	*fullpkgpath, *stem, *pkgname, *descr;
+	const char	*comment, *maintainer, *readme, *www;
+	const char	*version;
 
-	if (server_reply(clt, 20, "text/gemini") == -1)
-		goto err;
+	fullpkgpath = sqlite3_column_text(stmt, 0);
+	stem = sqlite3_column_text(stmt, 1);
+	comment = sqlite3_column_text(stmt, 2);
+	pkgname = sqlite3_column_text(stmt, 3);
+	descr = sqlite3_column_text(stmt, 4);
+	maintainer = sqlite3_column_text(stmt, 5);
+	readme = sqlite3_column_text(stmt, 6);
+	www = sqlite3_column_text(stmt, 7);
 
-	if (clt_printf(clt, "# %s v%s\n", path, version) == -1 ||
-	    clt_puts(clt, "\n") == -1 ||
-	    clt_printf(clt, "``` Command to install the package %s\n",
-	    stem) == -1 ||
-	    clt_printf(clt, "# pkg_add %s\n", stem) == -1 ||
-	    clt_printf(clt, "```\n") == -1 ||
-	    clt_printf(clt, "\n") == -1 ||
-	    clt_printf(clt, "> %s\n", comment) == -1 ||
-	    clt_printf(clt, "\n") == -1 ||
-	    clt_printf(clt, "=> https://cvsweb.openbsd.org/ports/%s "
-	    "CVS Web\n", fullpkgpath) == -1)
-		goto err;
+	for (;;) {
+		if (clt_congested(clt)) {
+			clt_suspend(clt, route_port_body);
+			return (0);
+		}
 
-	if (www && *www != '\0' &&
-	    clt_printf(clt, "=> %s Port Homepage (WWW)\n", www) == -1)
-		goto err;
+		switch (clt->clt_count++) {
+		case 0:
+			if ((version = strrchr(pkgname, '-')) != NULL)
+				version++;
+			else
+				version = " unknown";
 
-	if (clt_printf(clt, "\n") == -1 ||
-	    clt_printf(clt, "Maintainer: ") == -1 ||
-	    print_maintainer(clt, maintainer) == -1 ||
-	    clt_puts(clt, "\n\n") == -1 ||
-	    clt_printf(clt, "## Description\n\n") == -1 ||
-	    clt_printf(clt, "``` %s description\n", stem) == -1 ||
-	    clt_puts(clt, descr) == -1 ||
-	    clt_puts(clt, "```\n") == -1 ||
-	    clt_puts(clt, "\n") == -1)
-		goto err;
+			if (server_reply(clt, 20, "text/gemini") == -1)
+				return (-1);
 
-	if (readme && *readme != '\0') {
-		if (clt_puts(clt, "## Readme\n\n") == -1 ||
-		    clt_puts(clt, "\n") == -1 ||
-		    clt_printf(clt, "``` README for %s\n", stem) == -1 ||
-		    clt_puts(clt, readme) == -1 ||
-		    clt_puts(clt, "\n") == -1)
-			goto err;
-	}
+			if (clt_printf(clt, "# %s v%s\n", path, version) == -1 ||
+			    clt_puts(clt, "\n") == -1 ||
+			    clt_printf(clt, "``` Command to install the "
+			    "package %s\n", stem) == -1 ||
+			    clt_printf(clt, "# pkg_add %s\n", stem) == -1 ||
+			    clt_printf(clt, "```\n") == -1 ||
+			    clt_printf(clt, "\n") == -1 ||
+			    clt_printf(clt, "> %s\n", comment) == -1 ||
+			    clt_printf(clt, "\n") == -1 ||
+			    clt_printf(clt, "=> https://cvsweb.openbsd.org/"
+			    "ports/%s CVS Web\n", fullpkgpath) == -1)
+				return (-1);
 
- done:
-	sqlite3_reset(env->env_qfullpkgpath);
-	return (fcgi_end_request(clt, 0));
+			if (www && *www != '\0' &&
+			    clt_printf(clt, "=> %s Port Homepage (WWW)\n",
+			    www) == -1)
+				return (-1);
 
- err:
-	sqlite3_reset(env->env_qfullpkgpath);
-	return (-1);
+			if (clt_printf(clt, "\n") == -1 ||
+			    clt_printf(clt, "Maintainer: ") == -1 ||
+			    print_maintainer(clt, maintainer) == -1 ||
+			    clt_puts(clt, "\n\n") == -1)
+				return (-1);
+			break;
+
+		case 1:
+			if (clt_printf(clt, "## Description\n\n") == -1 ||
+			    clt_printf(clt, "``` %s description\n",
+			    stem) == -1 ||
+			    clt_puts(clt, descr) == -1 ||
+			    clt_puts(clt, "```\n") == -1 ||
+			    clt_puts(clt, "\n") == -1)
+				return (-1);
+			break;
+
+		case 2:
+			if (readme == NULL || *readme == '\0')
+				break;
+			if (clt_puts(clt, "## Readme\n\n") == -1 ||
+			    clt_puts(clt, "\n") == -1 ||
+			    clt_printf(clt, "``` README for %s\n",
+			    stem) == -1 ||
+			    clt_puts(clt, readme) == -1 ||
+			    clt_puts(clt, "\n") == -1)
+				return (-1);
+			break;
+
+		default:
+			server_stmt_release(env, clt);
+			return (server_cache_end(clt, 0));
+		}
+	}
 }
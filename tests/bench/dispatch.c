@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Cost of finding the client of a record, with the splay tree that
+ * fcgi.c used to keep and with the table indexed by request id that
+ * replaced it, for 1, 16 and 256 requests multiplexed on a connection
+ * whose records come interleaved.
+ */
+
+#include <sys/tree.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOOKUPS		(20 * 1000 * 1000)
+
+struct client {
+	uint32_t		 clt_id;
+	SPLAY_ENTRY(client)	 clt_nodes;
+	char			 clt_rest[2048];	/* like the real one */
+};
+
+SPLAY_HEAD(client_tree, client);
+
+static int
+fcgi_client_cmp(struct client *a, struct client *b)
+{
+	return ((int)a->clt_id - b->clt_id);
+}
+
+SPLAY_PROTOTYPE(client_tree, client, clt_nodes, fcgi_client_cmp);
+SPLAY_GENERATE(client_tree, client, clt_nodes, fcgi_client_cmp);
+
+static volatile uint32_t	 sink;
+
+static double
+now(void)
+{
+	struct timespec		 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+bench(int k)
+{
+	struct client_tree	 tree;
+	struct client		**table, *clt, q;
+	size_t			 maxclients;
+	double			 t0, t1, t2;
+	long			 r, rounds;
+	int			 i;
+
+	SPLAY_INIT(&tree);
+	for (maxclients = 16; maxclients <= (size_t)k; maxclients *= 2)
+		;
+	if ((table = calloc(maxclients, sizeof(*table))) == NULL)
+		err(1, "calloc");
+
+	for (i = 1; i <= k; ++i) {
+		if ((clt = calloc(1, sizeof(*clt))) == NULL)
+			err(1, "calloc");
+		clt->clt_id = i;
+		SPLAY_INSERT(client_tree, &tree, clt);
+		table[i] = clt;
+	}
+
+	rounds = LOOKUPS / k;
+
+	t0 = now();
+	for (r = 0; r < rounds; ++r) {
+		for (i = 1; i <= k; ++i) {
+			q.clt_id = i;
+			clt = SPLAY_FIND(client_tree, &tree, &q);
+			sink = clt->clt_id;
+		}
+	}
+	t1 = now();
+	for (r = 0; r < rounds; ++r) {
+		for (i = 1; i <= k; ++i) {
+			clt = (size_t)i < maxclients ? table[i] : NULL;
+			sink = clt->clt_id;
+		}
+	}
+	t2 = now();
+
+	printf("%3d requests: splay %.1f ns/record, table %.1f ns/record\n",
+	    k, (t1 - t0) * 1e9 / (rounds * k),
+	    (t2 - t1) * 1e9 / (rounds * k));
+
+	while ((clt = SPLAY_MIN(client_tree, &tree)) != NULL) {
+		SPLAY_REMOVE(client_tree, &tree, clt);
+		free(clt);
+	}
+	free(table);
+}
+
+int
+main(void)
+{
+	bench(1);
+	bench(16);
+	bench(256);
+	return (0);
+}
@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Send FastCGI requests to pkg_fcgi over a single keep-alive
+ * connection and report how fast they were answered.  The paths to
+ * request are given as arguments, or one per line on stdin, and are
+ * cycled through until the wanted number of requests is done.  With
+ * -k they are sent in batches of that many multiplexed requests, and
+ * with -P every parameter goes in a FCGI_PARAMS record of its own.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FCGI_BEGIN_REQUEST	1
+#define FCGI_END_REQUEST	3
+#define FCGI_PARAMS		4
+#define FCGI_STDIN		5
+#define FCGI_STDOUT		6
+#define FCGI_RESPONDER		1
+#define FCGI_KEEP_CONN		1
+
+#define SCRIPT_NAME		"/cgi"
+
+struct buf {
+	uint8_t			*b;
+	size_t			 len;
+	size_t			 size;
+};
+
+static char			**paths;
+static size_t			 npaths;
+static unsigned long long	 nrecords;
+static int			 split;
+
+static void
+buf_add(struct buf *buf, const void *data, size_t len)
+{
+	while (buf->len + len > buf->size) {
+		buf->size = buf->size == 0 ? 4096 : buf->size * 2;
+		if ((buf->b = realloc(buf->b, buf->size)) == NULL)
+			err(1, "realloc");
+	}
+	memcpy(buf->b + buf->len, data, len);
+	buf->len += len;
+}
+
+static void
+add_record(struct buf *buf, int type, int id, const void *body, size_t len)
+{
+	uint8_t			 hdr[8];
+
+	hdr[0] = 1;
+	hdr[1] = type;
+	hdr[2] = id >> 8;
+	hdr[3] = id & 0xFF;
+	hdr[4] = len >> 8;
+	hdr[5] = len & 0xFF;
+	hdr[6] = 0;
+	hdr[7] = 0;
+	buf_add(buf, hdr, sizeof(hdr));
+	buf_add(buf, body, len);
+	nrecords++;
+}
+
+static void
+add_len(struct buf *buf, size_t len)
+{
+	uint8_t			 l[4];
+
+	if (len < 128) {
+		l[0] = len;
+		buf_add(buf, l, 1);
+		return;
+	}
+	l[0] = (len >> 24) | 0x80;
+	l[1] = len >> 16;
+	l[2] = len >> 8;
+	l[3] = len;
+	buf_add(buf, l, 4);
+}
+
+/*
+ * Append a pair to params, sending it in a record of its own with -P.
+ */
+static void
+add_param(struct buf *out, int id, struct buf *params, const char *name,
+    const char *value, size_t vlen)
+{
+	add_len(params, strlen(name));
+	add_len(params, vlen);
+	buf_add(params, name, strlen(name));
+	buf_add(params, value, vlen);
+	if (split) {
+		add_record(out, FCGI_PARAMS, id, params->b, params->len);
+		params->len = 0;
+	}
+}
+
+static void
+add_request(struct buf *out, int id, const char *path)
+{
+	static struct buf	 params;
+	const char		*q;
+	uint8_t			 begin[8];
+
+	memset(begin, 0, sizeof(begin));
+	begin[1] = FCGI_RESPONDER;
+	begin[2] = FCGI_KEEP_CONN;
+	add_record(out, FCGI_BEGIN_REQUEST, id, begin, sizeof(begin));
+
+	if ((q = strchr(path, '?')) == NULL)
+		q = path + strlen(path);
+
+	params.len = 0;
+	add_param(out, id, &params, "SERVER_NAME", "localhost", 9);
+	add_param(out, id, &params, "SCRIPT_NAME", SCRIPT_NAME,
+	    strlen(SCRIPT_NAME));
+	add_param(out, id, &params, "PATH_INFO", path, q - path);
+	add_param(out, id, &params, "QUERY_STRING", *q ? q + 1 : q,
+	    *q ? strlen(q + 1) : 0);
+	add_param(out, id, &params, "REQUEST_METHOD", "GET", 3);
+	if (params.len > 0)
+		add_record(out, FCGI_PARAMS, id, params.b, params.len);
+
+	add_record(out, FCGI_PARAMS, id, NULL, 0);
+	add_record(out, FCGI_STDIN, id, NULL, 0);
+}
+
+/*
+ * Read until n requests are ended, returning the bytes of FCGI_STDOUT
+ * received.  Exit if any of them failed.
+ */
+static unsigned long long
+read_replies(int s, int n)
+{
+	static struct buf	 in;
+	unsigned long long	 bytes = 0;
+	uint8_t			*hdr;
+	size_t			 off = 0, len;
+	ssize_t			 r;
+
+	in.len = 0;
+	while (n > 0) {
+		len = 8;
+		if (in.len - off >= 8)
+			len += ((in.b[off + 4] << 8) | in.b[off + 5]) +
+			    in.b[off + 6];
+		if (in.len - off < len) {
+			if (off > 0 && in.size - in.len < 65536) {
+				memmove(in.b, in.b + off, in.len - off);
+				in.len -= off;
+				off = 0;
+			}
+			if (in.size - in.len < 65536) {
+				in.size = in.size == 0 ? 131072 : in.size * 2;
+				if ((in.b = realloc(in.b, in.size)) == NULL)
+					err(1, "realloc");
+			}
+			if ((r = read(s, in.b + in.len, in.size - in.len))
+			    == -1)
+				err(1, "read");
+			if (r == 0)
+				errx(1, "connection closed by pkg_fcgi");
+			in.len += r;
+			continue;
+		}
+
+		hdr = in.b + off;
+		len = (hdr[4] << 8) | hdr[5];
+		if (hdr[1] == FCGI_STDOUT)
+			bytes += len;
+		else if (hdr[1] == FCGI_END_REQUEST) {
+			if (hdr[8 + 4] != 0)
+				errx(1, "request %d: protocol status %d",
+				    (hdr[2] << 8) | hdr[3], hdr[8 + 4]);
+			n--;
+		}
+		off += 8 + len + hdr[6];
+	}
+
+	return (bytes);
+}
+
+static void
+read_paths(void)
+{
+	char			*line = NULL;
+	size_t			 linesize = 0;
+	ssize_t			 linelen;
+
+	while ((linelen = getline(&line, &linesize, stdin)) != -1) {
+		if (linelen > 0 && line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		if (linelen == 0)
+			continue;
+		if ((paths = reallocarray(paths, npaths + 1,
+		    sizeof(*paths))) == NULL)
+			err(1, "reallocarray");
+		if ((paths[npaths++] = strdup(line)) == NULL)
+			err(1, "strdup");
+	}
+	free(line);
+	if (ferror(stdin))
+		err(1, "getline");
+}
+
+static __dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-P] [-k inflight] [-n requests]"
+	    " -s socket [path ...]\n", getprogname());
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_un	 sun;
+	struct timespec		 t0, t1;
+	struct buf		 out;
+	unsigned long long	 bytes = 0;
+	const char		*sock = NULL, *errstr;
+	double			 secs;
+	long long		 n = -1, done;
+	int			 ch, i, k = 1, s;
+
+	while ((ch = getopt(argc, argv, "Pk:n:s:")) != -1) {
+		switch (ch) {
+		case 'P':
+			split = 1;
+			break;
+		case 'k':
+			/* as many as pkg_fcgi takes on a connection */
+			k = strtonum(optarg, 1, 1024, &errstr);
+			if (errstr)
+				errx(1, "inflight is %s: %s", errstr, optarg);
+			break;
+		case 'n':
+			n = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr)
+				errx(1, "requests are %s: %s", errstr, optarg);
+			break;
+		case 's':
+			sock = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (sock == NULL)
+		usage();
+
+	if (argc > 0) {
+		paths = argv;
+		npaths = argc;
+	} else
+		read_paths();
+	if (npaths == 0)
+		errx(1, "no paths to request");
+	if (n == -1)
+		n = npaths;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, sock, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		errx(1, "socket path too long: %s", sock);
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "connect %s", sock);
+
+	memset(&out, 0, sizeof(out));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (done = 0; done < n; done += i) {
+		out.len = 0;
+		for (i = 0; i < k && done + i < n; ++i)
+			add_request(&out, i + 1, paths[(done + i) % npaths]);
+		if (write(s, out.b, out.len) != (ssize_t)out.len)
+			err(1, "write");
+		bytes += read_replies(s, i);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%lld requests, %llu records, %llu bytes in %.3fs:"
+	    " %.0f requests/s, %.0f records/s\n", n, nrecords, bytes, secs,
+	    n / secs, nrecords / secs);
+
+	close(s);
+	return (0);
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Count the calls to malloc, calloc and realloc of a process, to be
+ * loaded with LD_PRELOAD.  The total so far is written to standard
+ * error upon SIGUSR2.
+ */
+
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void	*malloc(size_t);
+void	*calloc(size_t, size_t);
+void	*realloc(void *, size_t);
+void	 free(void *);
+
+static void	*(*real_malloc)(size_t);
+static void	*(*real_calloc)(size_t, size_t);
+static void	*(*real_realloc)(void *, size_t);
+static void	 (*real_free)(void *);
+
+static volatile unsigned long	 nallocs;
+
+/* dlsym may calloc before we know where the real one is */
+static int			 resolving;
+static char			 boot[4096];
+static size_t			 bootlen;
+
+static void
+resolve(void)
+{
+	resolving = 1;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	resolving = 0;
+}
+
+/* zeroed already, as it's never reused */
+static void *
+boot_alloc(size_t size)
+{
+	void		*p;
+
+	size = (size + 15) & ~(size_t)15;
+	if (bootlen + size > sizeof(boot))
+		return (NULL);
+	p = boot + bootlen;
+	bootlen += size;
+	return (p);
+}
+
+static int
+is_boot(void *p)
+{
+	return ((char *)p >= boot && (char *)p < boot + sizeof(boot));
+}
+
+static void
+report(int sig)
+{
+	char		 buf[64];
+	int		 len;
+
+	len = snprintf(buf, sizeof(buf), "mcount: %lu allocations\n",
+	    nallocs);
+	if (len > 0)
+		(void) write(STDERR_FILENO, buf, len);
+}
+
+__attribute__((constructor)) static void
+mcount_init(void)
+{
+	if (real_malloc == NULL)
+		resolve();
+	signal(SIGUSR2, report);
+}
+
+void *
+malloc(size_t size)
+{
+	if (resolving)
+		return (boot_alloc(size));
+	if (real_malloc == NULL)
+		resolve();
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	return (real_malloc(size));
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	if (resolving)
+		return (boot_alloc(nmemb * size));
+	if (real_calloc == NULL)
+		resolve();
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	return (real_calloc(nmemb, size));
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	void		*p;
+	size_t		 n;
+
+	if (real_realloc == NULL)
+		resolve();
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	if (ptr != NULL && is_boot(ptr)) {
+		n = boot + sizeof(boot) - (char *)ptr;
+		if ((p = real_malloc(size)) != NULL)
+			memcpy(p, ptr, size < n ? size : n);
+		return (p);
+	}
+	return (real_realloc(ptr, size));
+}
+
+void
+free(void *ptr)
+{
+	if (ptr == NULL || is_boot(ptr))
+		return;
+	if (real_free == NULL)
+		resolve();
+	real_free(ptr);
+}
@@ -0,0 +1,158 @@
+#!/bin/sh
+#
+# Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+# Run pkg_fcgi with a single child on a copy of the given database and
+# measure it with fcgibench.  Needs to be run as root, like pkg_fcgi,
+# from the top of the source tree once `make bench' built everything.
+
+set -e
+
+usage() {
+	echo "usage: $0 [-u user] database" >&2
+	exit 1
+}
+
+user=nobody
+while getopts u: opt; do
+	case $opt in
+	u) user=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 1 ] || usage
+db=$1
+
+root=$(mktemp -d /tmp/pkg_fcgi.bench.XXXXXXXXXX)
+pid=
+
+cleanup() {
+	[ -n "$pid" ] && kill "$pid" 2>/dev/null && wait "$pid" || true
+	rm -rf "$root"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$root/pkg_fcgi" "$root/run"
+cp "$db" "$root/pkg_fcgi/pkgs.sqlite3"
+chmod -R a+rX "$root"
+sock=$root/run/pkg_fcgi.sock
+
+# every port once, as the category listings link them
+sqlite3 "$db" 'select fullpkgpath from categories' | sed 's,^,/,' \
+    >"$root/ports"
+
+# count the allocations too, where the shim could be built
+preload=
+[ -f tests/bench/mcount.so ] && preload=$PWD/tests/bench/mcount.so
+
+LD_PRELOAD=$preload ./pkg_fcgi -d -j 1 -u "$user" -p "$root" \
+    -s /run/pkg_fcgi.sock /pkg_fcgi/pkgs.sqlite3 2>"$root/log" &
+pid=$!
+
+i=0
+while [ ! -S "$sock" ] || [ -z "$(pgrep -P "$pid")" ]; do
+	i=$((i + 1))
+	[ $i -lt 50 ] || { cat "$root/log" >&2; exit 1; }
+	sleep 0.1
+done
+child=$(pgrep -P "$pid")
+sleep 0.5
+
+bench() {
+	tests/bench/fcgibench -s "$sock" "$@"
+}
+
+# sum of the output counters logged by the child on SIGUSR1
+output() {
+	kill -USR1 "$child"
+	sleep 0.2
+	awk '
+	/output: .* bytes staged/ { staged = $3; direct = $8 }
+	/output: .* replies/ { replies = $3; records = $5 }
+	END { print staged + 0, direct + 0, replies + 0, records + 0 }
+	' "$root/log"
+}
+
+# allocations made by the child so far
+mallocs() {
+	[ -n "$preload" ] || { echo 0; return; }
+	kill -USR2 "$child"
+	sleep 0.2
+	awk '/^mcount: / { n = $2 } END { print n + 0 }' "$root/log"
+}
+
+# allocations per request between two snapshots
+allocs() {
+	[ -n "$preload" ] || return 0
+	echo "$1 $2 $3" | awk '{
+		printf "%.2f allocations per request\n", ($2 - $1) / $3
+	}'
+}
+
+# bytes copied and records per reply between two output snapshots
+copies() {
+	echo "$1 $2" | awk '{
+		n = $7 - $3
+		if (n == 0)
+			n = 1
+		printf "%.0f bytes copied per reply, %.2f records per reply\n",
+		    (2 * ($5 - $1) + ($6 - $2)) / n, ($8 - $4) / n
+	}'
+}
+
+# cpu time used by the child so far in us, where /proc tells
+cpu() {
+	[ -r "/proc/$child/stat" ] || { echo 0; return; }
+	sed 's/.*) //' "/proc/$child/stat" | awk -v hz="$(getconf CLK_TCK)" \
+	    '{ printf "%.0f\n", ($12 + $13) * 1000000 / hz }'
+}
+
+nports=$(wc -l <"$root/ports")
+
+echo "== port pages, rendered"
+m=$(mallocs); a=$(output)
+bench <"$root/ports"
+b=$(output); n=$(mallocs)
+copies "$a" "$b"
+allocs "$m" "$n" "$nports"
+
+echo "== port pages, from the cache"
+m=$(mallocs); a=$(output)
+bench <"$root/ports"
+b=$(output); n=$(mallocs)
+copies "$a" "$b"
+allocs "$m" "$n" "$nports"
+
+echo "== multiplexed requests for a cached page"
+for k in 1 16 256; do
+	printf "%3d in flight: " $k
+	bench -k $k -n 20000 /
+done
+
+echo "== records of a cached page, one parameter per record"
+for k in 1 16; do
+	printf "%3d in flight: " $k
+	c=$(cpu)
+	bench -P -k $k -n 100000 /
+	[ -r "/proc/$child/stat" ] &&
+	    echo "$c $(cpu)" | awk '{
+		printf "               %.1fus of cpu per request\n",
+		    ($2 - $1) / 100000
+	    }'
+done
+
+echo "== finding the client of a record"
+tests/bench/dispatch
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "log.h"
+#include "pkg.h"
+
+/*
+ * Searches are run by a pool of threads, each with its own read-only
+ * connection to the database, so that a slow FTS query doesn't stall
+ * every other client of the process.  The rows are copied out of
+ * sqlite and the finished job is handed back to the event loop
+ * through a pipe.  Threads never touch libevent or the clients.
+ */
+
+static pthread_mutex_t		 wrk_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		 wrk_cond = PTHREAD_COND_INITIALIZER;
+static TAILQ_HEAD(, job)	 wrk_jobs = TAILQ_HEAD_INITIALIZER(wrk_jobs);
+static int			 wrk_gen;	/* bumped to re-open the db */
+
+static const char		*wrk_dbpath;
+static const char		*wrk_sql;
+static int			 wrk_pipe[2];
+static struct event		 wrk_ev;
+
+static int	worker_add_row(struct job *, sqlite3_stmt *);
+static void	worker_run(sqlite3_stmt *, struct job *);
+static void	*worker_main(void *);
+static void	worker_done(int, short, void *);
+
+void
+worker_init(const char *dbpath, const char *sql, int nworkers)
+{
+	pthread_t	 t;
+	sigset_t	 set, oset;
+	int		 i;
+
+	wrk_dbpath = dbpath;
+	wrk_sql = sql;
+
+	if (pipe(wrk_pipe) == -1)
+		fatal("pipe");
+	if (fcntl(wrk_pipe[0], F_SETFL, O_NONBLOCK) == -1)
+		fatal("fcntl");
+
+	event_set(&wrk_ev, wrk_pipe[0], EV_READ | EV_PERSIST, worker_done,
+	    NULL);
+	event_add(&wrk_ev, NULL);
+
+	/* signals are for the event loop only */
+	sigfillset(&set);
+	if (pthread_sigmask(SIG_BLOCK, &set, &oset) != 0)
+		fatalx("pthread_sigmask");
+
+	for (i = 0; i < nworkers; ++i) {
+		if (pthread_create(&t, NULL, worker_main, NULL) != 0)
+			fatalx("pthread_create");
+		pthread_detach(t);
+	}
+
+	if (pthread_sigmask(SIG_SETMASK, &oset, NULL) != 0)
+		fatalx("pthread_sigmask");
+}
+
+/*
+ * Make the workers re-open the database before their next job.  The
+ * idle ones are woken up to let go of the old one right away.
+ */
+void
+worker_reload(void)
+{
+	pthread_mutex_lock(&wrk_mtx);
+	wrk_gen++;
+	pthread_cond_broadcast(&wrk_cond);
+	pthread_mutex_unlock(&wrk_mtx);
+}
+
+struct job *
+worker_job_new(struct client *clt, const char *text)
+{
+	struct job	*job;
+
+	if ((job = calloc(1, sizeof(*job))) == NULL)
+		return (NULL);
+	if ((job->j_text = strdup(text)) == NULL) {
+		free(job);
+		return (NULL);
+	}
+	job->j_clt = clt;
+	return (job);
+}
+
+void
+worker_job_free(struct job *job)
+{
+	free(job->j_text);
+	free(job->j_rows);
+	free(job);
+}
+
+void
+worker_submit(struct job *job, void (*cb)(struct job *))
+{
+	job->j_cb = cb;
+	job->j_state = JOB_QUEUED;
+
+	pthread_mutex_lock(&wrk_mtx);
+	TAILQ_INSERT_TAIL(&wrk_jobs, job, j_entry);
+	pthread_cond_signal(&wrk_cond);
+	pthread_mutex_unlock(&wrk_mtx);
+}
+
+/*
+ * The client went away: drop the job if it's still waiting in the
+ * queue, otherwise let worker_done free it once it's finished.
+ */
+void
+worker_cancel(struct job *job)
+{
+	int		 queued = 0;
+
+	pthread_mutex_lock(&wrk_mtx);
+	if (job->j_state == JOB_QUEUED) {
+		TAILQ_REMOVE(&wrk_jobs, job, j_entry);
+		queued = 1;
+	}
+	pthread_mutex_unlock(&wrk_mtx);
+
+	job->j_clt = NULL;
+	if (queued || job->j_state == JOB_DONE)
+		worker_job_free(job);
+}
+
+static int
+worker_add_row(struct job *job, sqlite3_stmt *stmt)
+{
+	const char	*col;
+	char		*t;
+	size_t		 len, cap;
+	int		 i;
+
+	for (i = 0; i < JOB_COLS; ++i) {
+		if ((col = sqlite3_column_text(stmt, i)) == NULL)
+			col = "";
+		len = strlen(col) + 1;
+
+		if (job->j_len + len > job->j_cap) {
+			cap = job->j_cap == 0 ? 4096 : job->j_cap;
+			while (job->j_len + len > cap)
+				cap *= 2;
+			if ((t = realloc(job->j_rows, cap)) == NULL)
+				return (-1);
+			job->j_rows = t;
+			job->j_cap = cap;
+		}
+
+		memcpy(job->j_rows + job->j_len, col, len);
+		job->j_len += len;
+	}
+
+	job->j_score = sqlite3_column_double(stmt, JOB_COLS);
+	job->j_rowid = sqlite3_column_int64(stmt, JOB_COLS + 1);
+	job->j_nrows++;
+	return (0);
+}
+
+static void
+worker_run(sqlite3_stmt *stmt, struct job *job)
+{
+	int		 err;
+
+	err = sqlite3_bind_text(stmt, 1, job->j_text, -1, SQLITE_STATIC);
+	if (err == SQLITE_OK && job->j_cursor)
+		err = sqlite3_bind_double(stmt, 2, job->j_score);
+	if (err == SQLITE_OK && job->j_cursor)
+		err = sqlite3_bind_int64(stmt, 3, job->j_rowid);
+	if (err == SQLITE_OK)
+		err = sqlite3_bind_int(stmt, 4, job->j_limit + 1);
+	if (err != SQLITE_OK) {
+		log_warnx("%s: sqlite3_bind \"%s\": %s", __func__,
+		    job->j_text, sqlite3_errstr(err));
+		goto done;
+	}
+
+	/*
+	 * Fetch one row more than needed to know whether there's
+	 * another page.
+	 */
+	for (;;) {
+		err = sqlite3_step(stmt);
+		if (err == SQLITE_DONE)
+			break;
+		if (err != SQLITE_ROW) {
+			log_warnx("%s: sqlite3_step %s", __func__,
+			    sqlite3_errstr(err));
+			goto done;
+		}
+		if (job->j_nrows == job->j_limit) {
+			job->j_more = 1;
+			break;
+		}
+		if (worker_add_row(job, stmt) == -1) {
+			log_warn("%s: realloc", __func__);
+			goto done;
+		}
+	}
+
+	job->j_ok = 1;
+
+ done:
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+static void *
+worker_main(void *arg)
+{
+	sqlite3		*db = NULL;
+	sqlite3_stmt	*stmt = NULL;
+	struct image	*img = NULL;
+	struct job	*job;
+	ssize_t		 r;
+	int		 err, gen = -1, g;
+
+	for (;;) {
+		pthread_mutex_lock(&wrk_mtx);
+		while ((job = TAILQ_FIRST(&wrk_jobs)) == NULL &&
+		    (db == NULL || wrk_gen == gen))
+			pthread_cond_wait(&wrk_cond, &wrk_mtx);
+		if (job != NULL) {
+			TAILQ_REMOVE(&wrk_jobs, job, j_entry);
+			job->j_state = JOB_RUNNING;
+		}
+		g = wrk_gen;
+		pthread_mutex_unlock(&wrk_mtx);
+
+		/*
+		 * Woken up by worker_reload: let the main thread know
+		 * the descriptors changed with a NULL job.
+		 */
+		if (job == NULL) {
+			sqlite3_finalize(stmt);
+			server_disconnect(db, img);
+			stmt = NULL;
+			db = NULL;
+			img = NULL;
+			gen = -1;
+			do {
+				r = write(wrk_pipe[1], &job, sizeof(job));
+			} while (r == -1 && errno == EINTR);
+			if (r != sizeof(job))
+				fatal("%s: write", __func__);
+			continue;
+		}
+
+		if (g != gen) {
+			sqlite3_finalize(stmt);
+			server_disconnect(db, img);
+			stmt = NULL;
+
+			err = server_connect(&db, &img);
+			if (err == SQLITE_OK)
+				err = sqlite3_prepare_v2(db, wrk_sql, -1,
+				    &stmt, NULL);
+			if (err != SQLITE_OK)
+				log_warnx("%s: can't open database %s: %s",
+				    __func__, wrk_dbpath, sqlite3_errstr(err));
+			else
+				gen = g;
+			job->j_reopened = 1;
+		}
+
+		if (stmt != NULL)
+			worker_run(stmt, job);
+
+		do {
+			r = write(wrk_pipe[1], &job, sizeof(job));
+		} while (r == -1 && errno == EINTR);
+		if (r != sizeof(job))
+			fatal("%s: write", __func__);
+	}
+
+	return (NULL);
+}
+
+static void
+worker_done(int fd, short ev, void *arg)
+{
+	struct job	*jobs[64];
+	struct job	*job;
+	ssize_t		 r;
+	size_t		 i;
+
+	for (;;) {
+		r = read(fd, jobs, sizeof(jobs));
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1 && errno == EAGAIN)
+			return;
+		if (r <= 0)
+			fatal("%s: read", __func__);
+
+		/* writes of a pointer are atomic */
+		for (i = 0; i < r / sizeof(*jobs); ++i) {
+			job = jobs[i];
+			if (job == NULL) {
+				/* an idle worker closed its database */
+				fd_recount();
+				continue;
+			}
+			job->j_state = JOB_DONE;
+			if (job->j_reopened)
+				fd_recount();
+			if (job->j_clt == NULL)
+				worker_job_free(job);
+			else
+				job->j_cb(job);
+		}
+	}
+}